@@ -0,0 +1,101 @@
+/*
+Modmata Arena
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Arena.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Bump allocator for per-request memory, and free RAM statistics
+ * @date 2023-04-06
+ */
+
+#include "Arena.h"
+
+/** @brief Memory handed out by arenaAlloc() */
+static uint8_t arena[ARENA_SIZE];
+
+/** @brief Bytes of the arena handed out since the last reset */
+static size_t arenaUsed = 0;
+
+/** @brief Heap allocations made because the arena was full, freed on the next reset */
+static void *overflow[ARENA_OVERFLOW];
+
+/** @brief Number of valid entries in 'overflow' */
+static uint8_t overflowCount = 0;
+
+/** @brief Input registers holding the memory statistics (see MEMORY_FREE and following) */
+word memoryRegisters[MEMORY_REG_COUNT] = {0, 0xFFFF, 0, 0, 0, ARENA_SIZE, 0, 0};
+
+/**
+ * @brief Allocate memory that lasts until the end of the current task() or processInput() cycle.
+ * Callbacks should use this for scratch space and results instead of malloc(), which fragments the heap.
+ * The memory must not be freed.
+ * 
+ * @param size The number of bytes needed
+ * @return A pointer to the memory, or nullptr if neither the arena nor the heap has room
+ */
+void *arenaAlloc(size_t size) {
+	if (size <= ARENA_SIZE - arenaUsed) {
+		void *ptr = arena + arenaUsed;
+		arenaUsed += size;
+		if (arenaUsed > memoryRegisters[MEMORY_ARENA_MAX]) memoryRegisters[MEMORY_ARENA_MAX] = arenaUsed;
+		return ptr;
+	}
+
+	// Fall back to the heap rather than fail, and count it so the arena can be resized
+	void *ptr = (overflowCount < ARENA_OVERFLOW ? malloc(size) : nullptr);
+	if (ptr == nullptr) {
+		memoryRegisters[MEMORY_FAILURES]++;
+		return nullptr;
+	}
+	overflow[overflowCount++] = ptr;
+	memoryRegisters[MEMORY_OVERFLOWS]++;
+	return ptr;
+}
+
+/**
+ * @brief Check whether memory was handed out by arenaAlloc(), and so must not be freed
+ * 
+ * @param ptr The pointer to check
+ * @return True if the pointer came from arenaAlloc()
+ */
+bool arenaOwns(const void *ptr) {
+	if (ptr >= arena && ptr < arena + ARENA_SIZE) return true;
+	for (uint8_t i = 0; i < overflowCount; i++) {
+		if (overflow[i] == ptr) return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Release everything handed out by arenaAlloc()
+ */
+void arenaReset() {
+	while (overflowCount > 0) {
+		free(overflow[--overflowCount]);
+	}
+	arenaUsed = 0;
+}
+
+/**
+ * @brief Sample free RAM and heap size into the memory statistics registers.
+ * Called where the stack is deepest, so the lowest free RAM seen is a useful warning.
+ */
+void memoryUpdate() {
+#ifdef __AVR__
+	extern char *__brkval;
+	extern char __heap_start;
+
+	char *heapTop = (__brkval ? __brkval : &__heap_start);
+	char stackTop;
+	word freeRam = &stackTop - heapTop;
+	word heap = heapTop - &__heap_start;
+
+	memoryRegisters[MEMORY_FREE] = freeRam;
+	if (freeRam < memoryRegisters[MEMORY_FREE_MIN]) memoryRegisters[MEMORY_FREE_MIN] = freeRam;
+	memoryRegisters[MEMORY_HEAP] = heap;
+	if (heap > memoryRegisters[MEMORY_HEAP_MAX]) memoryRegisters[MEMORY_HEAP_MAX] = heap;
+#endif
+}
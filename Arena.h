@@ -0,0 +1,49 @@
+/*
+Modmata Arena
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Arena.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Arena.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/** @brief Bytes of scratch memory handed out between resets. Large enough for a 125 register read,
+ * or for a full mailbox of arguments plus a typical result. The arena is static SRAM, so a build that
+ * only sends short commands can shrink it with a build flag (e.g. -DARENA_SIZE=128); larger requests
+ * then spill over to the heap (see ARENA_OVERFLOW) or are refused */
+#ifndef ARENA_SIZE
+#define ARENA_SIZE 320
+#endif
+
+/** @brief Number of allocations that can spill over to the heap when the arena is full */
+#define ARENA_OVERFLOW 4
+
+// Layout of the memory statistics input registers
+
+#define MEMORY_FREE 0
+#define MEMORY_FREE_MIN 1
+#define MEMORY_HEAP 2
+#define MEMORY_HEAP_MAX 3
+#define MEMORY_ARENA_MAX 4
+#define MEMORY_ARENA_SIZE 5
+#define MEMORY_OVERFLOWS 6
+#define MEMORY_FAILURES 7
+#define MEMORY_REG_COUNT 8
+
+extern word memoryRegisters[MEMORY_REG_COUNT];
+
+void *arenaAlloc(size_t size);
+bool arenaOwns(const void *ptr);
+void arenaReset();
+void memoryUpdate();
+
+#endif
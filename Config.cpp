@@ -0,0 +1,230 @@
+/*
+Modmata Config
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Config.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Record setup commands into an EEPROM profile that is replayed at startup
+ * @date 2023-04-06
+ */
+
+#include <util/crc16.h>
+#include "Config.h"
+
+#ifdef USE_CONFIG
+
+/** @brief EEPROM address of the stored profile */
+static uint16_t configAddress = CONFIG_EEPROM_ADDR;
+
+/** @brief Input registers describing the stored profile (see CONFIG_STATE and following) */
+word configRegisters[CONFIG_REG_COUNT];
+
+/** @brief True between CONFIGBEGIN and CONFIGCOMMIT */
+static bool recording = false;
+
+/** @brief True if a command did not fit in the EEPROM while recording */
+static bool overflowed = false;
+
+/** @brief Bytes of commands recorded so far */
+static uint16_t recordLength = 0;
+
+/** @brief Hash of the commands recorded so far */
+static uint16_t recordHash = 0xFFFF;
+
+/**
+ * @brief Write a 16-bit value to the EEPROM, high byte first
+ * 
+ * @param address The EEPROM address
+ * @param value The value to write
+ */
+static void configWriteWord(int address, uint16_t value) {
+	EEPROM.update(address, highByte(value));
+	EEPROM.update(address + 1, lowByte(value));
+}
+
+/**
+ * @brief Move the stored profile, so it stays clear of the sketch's own EEPROM data.
+ * Must be called before Modmata.begin(), which replays the profile.
+ * 
+ * @param address The EEPROM address of the profile, which takes CONFIG_HEADER bytes plus the commands recorded
+ * @return True if the address leaves room for the profile's header, otherwise the profile stays where it was
+ */
+bool configSetAddress(uint16_t address) {
+	if (address + CONFIG_HEADER > EEPROM.length()) return false;
+	configAddress = address;
+	return true;
+}
+
+/**
+ * @brief Check whether a command only sets the device up, so that replaying it at startup is safe.
+ * Reads, BAUDRATE, motion and bus traffic are left out, as are commands added with attach(), whose effect isn't known.
+ * 
+ * @param cmd The command #
+ * @return True if the command is recorded into the profile
+ */
+static bool configSetupCommand(uint8_t cmd) {
+	switch (cmd) {
+		case PINMODE:
+		case DIGITALWRITE:
+		case PORTMODE:
+		case PORTWRITE:
+		case PINEVENT:
+		case SERVOATTACH:
+		case WIREBEGIN:
+		case WIRECLOCK:
+		case WIREPOLL:
+		case SPIBEGIN:
+		case SPISETTINGS:
+		case SPISESSION:
+		case MACROLOAD:
+		case MACRORUN:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief Check the stored profile and describe it in the configuration registers
+ * 
+ * @return True if a complete profile with a matching hash is stored
+ */
+bool configLoad() {
+	configRegisters[CONFIG_STATE] &= ~CONFIG_STORED;
+	configRegisters[CONFIG_VERSION] = 0;
+	configRegisters[CONFIG_HASH] = 0;
+	configRegisters[CONFIG_LENGTH] = 0;
+	if (EEPROM.read(configAddress) != CONFIG_MAGIC) return false;
+
+	word version = makeWord(EEPROM.read(configAddress + 1), EEPROM.read(configAddress + 2));
+	word length = makeWord(EEPROM.read(configAddress + 3), EEPROM.read(configAddress + 4));
+	word hash = makeWord(EEPROM.read(configAddress + 5), EEPROM.read(configAddress + 6));
+	if (length > EEPROM.length() - configAddress - CONFIG_HEADER) return false;
+
+	uint16_t crc = 0xFFFF;
+	for (uint16_t i = 0; i < length; i++) {
+		crc = _crc16_update(crc, configRead(i));
+	}
+	if (crc != hash) return false;
+
+	configRegisters[CONFIG_STATE] |= CONFIG_STORED;
+	configRegisters[CONFIG_VERSION] = version;
+	configRegisters[CONFIG_HASH] = hash;
+	configRegisters[CONFIG_LENGTH] = length;
+	return true;
+}
+
+/**
+ * @brief Read one byte of the stored commands
+ * 
+ * @param index The position in the stored commands
+ * @return The byte
+ */
+uint8_t configRead(uint16_t index) {
+	return EEPROM.read(configAddress + CONFIG_HEADER + index);
+}
+
+/**
+ * @brief Check whether commands are being recorded into a new profile
+ * 
+ * @return True between CONFIGBEGIN and CONFIGCOMMIT
+ */
+bool configRecording() {
+	return recording;
+}
+
+/**
+ * @brief Append a setup command to the profile being recorded, as its command #, argc, then argv.
+ * Other commands still run, but are not recorded. Each byte written to the EEPROM takes about 3.4ms, so recording is only meant for setup.
+ * 
+ * @param cmd The command #
+ * @param argc The number of arguments
+ * @param argv The arguments, as they were before the command ran
+ */
+void configRecord(uint8_t cmd, uint8_t argc, const uint8_t *argv) {
+	if (!recording || !configSetupCommand(cmd)) return;
+
+	int address = configAddress + CONFIG_HEADER + recordLength;
+	if (address + 2 + argc > (int)EEPROM.length()) {
+		overflowed = true;
+		return;
+	}
+
+	EEPROM.update(address, cmd);
+	EEPROM.update(address + 1, argc);
+	recordHash = _crc16_update(_crc16_update(recordHash, cmd), argc);
+	for (int i = 0; i < argc; i++) {
+		EEPROM.update(address + 2 + i, argv[i]);
+		recordHash = _crc16_update(recordHash, argv[i]);
+	}
+	recordLength += 2 + argc;
+}
+
+/**
+ * @brief Start recording a new profile. The setup commands after this one, up to CONFIGCOMMIT, are stored
+ * and will be run again at startup (pin modes and initial levels, bus and servo setup, WIREPOLL, SPISESSION,
+ * PINEVENT, MACROLOAD and MACRORUN). The old profile is discarded straight away.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return void (empty struct)
+ */
+struct registers configBegin(uint8_t argc, uint8_t *argv) {
+	EEPROM.update(configAddress, 0);
+	configLoad();
+
+	recording = true;
+	overflowed = false;
+	recordLength = 0;
+	recordHash = 0xFFFF;
+	configRegisters[CONFIG_STATE] |= CONFIG_RECORDING;
+	return registers{0, nullptr};
+}
+
+/**
+ * @brief Stop recording and store the profile under a version chosen by the host. After a reset the
+ * host can compare the version and hash registers with its own setup and skip sending it again.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (2)
+ * @param argv The arguments to use within the function (16-bit version)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers configCommit(uint8_t argc, uint8_t *argv) {
+	struct registers result = resultAlloc(1);
+	if (result.value == nullptr) return result;
+	result.value[0] = 0;
+
+	if (argc == 2 && recording && !overflowed) {
+		configWriteWord(configAddress + 1, makeWord(argv[0], argv[1]));
+		configWriteWord(configAddress + 3, recordLength);
+		configWriteWord(configAddress + 5, recordHash);
+
+		// The magic goes last, so a reset part way through leaves no profile rather than a broken one
+		EEPROM.update(configAddress, CONFIG_MAGIC);
+		result.value[0] = configLoad();
+	}
+
+	recording = false;
+	configRegisters[CONFIG_STATE] &= ~CONFIG_RECORDING;
+	return result;
+}
+
+/**
+ * @brief Stop recording, if a profile was being recorded, and erase the stored profile
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return void (empty struct)
+ */
+struct registers configClear(uint8_t argc, uint8_t *argv) {
+	EEPROM.update(configAddress, 0);
+	recording = false;
+	configRegisters[CONFIG_STATE] = 0;
+	configLoad();
+	return registers{0, nullptr};
+}
+
+#endif
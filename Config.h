@@ -0,0 +1,68 @@
+/*
+Modmata Config
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Config.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Config.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "Functions.h"
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/** @brief Uncomment to let the host record setup commands into an EEPROM profile that is replayed at startup (see CONFIGBEGIN) */
+//#define USE_CONFIG
+
+#if defined(USE_CONFIG) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_CONFIG needs the input registers left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+/** @brief Default EEPROM address of the stored configuration profile. A sketch that keeps its own data in the EEPROM
+ * moves the profile out of its way with Modmata.setConfigAddress() */
+#ifndef CONFIG_EEPROM_ADDR
+#define CONFIG_EEPROM_ADDR 0
+#endif
+
+/** @brief First byte of a committed profile; anything else means there is none */
+#define CONFIG_MAGIC 0x4D
+
+/** @brief Bytes before the first command of a profile: magic, version (2), length (2), hash (2) */
+#define CONFIG_HEADER 7
+
+// Layout of the configuration input registers
+
+#define CONFIG_STATE 0
+#define CONFIG_VERSION 1
+#define CONFIG_HASH 2
+#define CONFIG_LENGTH 3
+#define CONFIG_REG_COUNT 4
+
+// Flags in the CONFIG_STATE register
+
+#define CONFIG_STORED 0x01
+#define CONFIG_RESTORED 0x02
+#define CONFIG_RECORDING 0x04
+
+#ifdef USE_CONFIG
+extern word configRegisters[CONFIG_REG_COUNT];
+
+bool configSetAddress(uint16_t address);
+bool configLoad();
+uint8_t configRead(uint16_t index);
+bool configRecording();
+void configRecord(uint8_t cmd, uint8_t argc, const uint8_t *argv);
+
+struct registers configBegin(uint8_t argc, uint8_t *argv);
+struct registers configCommit(uint8_t argc, uint8_t *argv);
+struct registers configClear(uint8_t argc, uint8_t *argv);
+#endif
+
+#endif
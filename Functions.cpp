@@ -13,21 +13,102 @@ Licensed under LGPL-2.1
 
 #include "Functions.h"
 
-/** @brief Current number of attached servos */
-int servo_count = 0;
+#ifdef USE_SERVO
+/** @brief Pool of servos, handed out by servoAttach() and returned by servoDetach() */
+struct servo_slot servos[SERVO_POOL_SIZE];
+#endif
 
-/** @brief Array to control attached servos */
-Servo servos[14];	// FIXME: Change to pointers so that pins 9/10 can be used as analog when Servos aren't used
+#ifdef USE_WIRE
+/** @brief True between WIREBEGIN (or an accepted WIREPOLL) and WIREEND, so background reads never touch a stopped bus */
+bool wireActive = false;
 
+#ifndef USE_HOLDING_REGISTERS_ONLY
+/** @brief I2C reads refreshed in the background by wirePollUpdate() */
+struct wire_poll polls[WIRE_POLL_SLOTS];
+
+/** @brief Input registers holding the latest result of each background I2C read */
+word wirePollRegisters[WIRE_POLL_REG_COUNT];
+#endif
+#endif
+
+#ifdef USE_SPI
 /** @brief Singleton to represent the current SPI connection settings */
 struct spi_settings settings;
 
+/** @brief SPI peripherals registered with SPISESSION */
+struct spi_session sessions[SPI_SESSIONS];
+
+/** @brief The session holding CS asserted between exchanges, or -1 */
+int8_t spiHeld = -1;
+#endif
+
+#ifdef USE_GPIO
+#ifdef USE_PIN_EVENTS
+/** @brief Pins watched for changes by PINEVENT */
+volatile struct event_pin eventPins[EVENT_PINS];
+
+/** @brief Pin changes waiting to be read by the host. Only eventScan() adds to it and only eventDrain() removes from it */
+volatile struct pin_event eventQueue[EVENT_QUEUE_SIZE];
+
+/** @brief Index the next event will be written to, advanced by eventScan() */
+volatile uint8_t eventHead = 0;
+
+/** @brief Index of the oldest unread event, advanced by eventDrain() */
+volatile uint8_t eventTail = 0;
+
+/** @brief Number of events lost because the queue was full */
+volatile word eventsDropped = 0;
+
+/** @brief Input registers the host reads pin events from (see EVENT_PENDING and following) */
+word eventRegisters[EVENT_REG_COUNT];
+#endif
+
+/** @brief Singleton to represent the analog burst running in the background, if any */
+volatile struct analog_burst burst;
+
+#ifdef USE_CAPTURE
+/** @brief Singleton to represent the capture being recorded by the ADC interrupt, if any */
+volatile struct capture_run capture;
+
+/** @brief Input registers the host reads the capture from */
+volatile struct capture_log captureLog;
+#endif
+
+#ifdef USE_NATIVE_IO
+/** @brief Coils and discrete inputs, one per digital pin. Both are filled in just before they are read */
+word ioPins[NUM_DIGITAL_PINS];
+
+/** @brief Input registers of the analog inputs, sampled just before they are read */
+word ioAnalog[NUM_ANALOG_INPUTS];
+#endif
+#endif
+
+#ifdef USE_BULK
+/** @brief Singleton to represent the bulk transfer in progress, if any */
+struct bulk_transfer bulk{BULK_CLOSED, 0, 0, 0, 0, 0};
+
+/** @brief The bytes received in the previous chunk, returned again if its response was lost */
+static uint8_t bulkChunk[BULK_CHUNK_MAX];
+#endif
+
 /** 
  * @brief Helper struct that is returned directly when a callback function has no return values,
  * and that is copy-constructed from when a clean struct is needed to populate with values
  */
 const registers VOID_STRUCT{0, nullptr};
 
+/**
+ * @brief Allocate the results of a callback from the arena
+ * 
+ * @param count The number of result bytes
+ * @return struct with room for 'count' bytes, or VOID_STRUCT if there is no memory left (or 'count' is 0)
+ */
+struct registers resultAlloc(uint8_t count) {
+	uint8_t *value = (count > 0 ? (uint8_t *)arenaAlloc(sizeof(uint8_t) * count) : nullptr);
+	return (value != nullptr ? registers{count, value} : VOID_STRUCT);
+}
+
+#ifdef USE_GPIO
 /**
  * @brief Change the settings of the Arduino I/O pins
  * 
@@ -55,63 +136,992 @@ struct registers digitalWrite(uint8_t argc, uint8_t *argv) {
 		digitalWrite(argv[0], argv[1]);
 	}
 
-	return VOID_STRUCT;
+	return VOID_STRUCT;
+}
+
+/**
+ * @brief Read a digital value (HIGH/LOW) from the Arduino I/O pins
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (1)
+ * @param argv The arguments to use within the function (pin #)
+ * @return struct containing the value of pin (1 uint8_t)
+ */
+struct registers digitalRead(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 1) {
+		uint8_t read_val = digitalRead(argv[0]);
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = read_val;
+	}
+
+	return result;
+}
+
+/**
+ * @brief Write an analog value (0-255) to the Arduino I/O pins
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (3)
+ * @param argv The arguments to use within the function (pin #, 16-bit value split into 2 8-bit values)
+ * @return void (empty struct)
+ */
+struct registers analogWrite(uint8_t argc, uint8_t *argv) {
+	if (argc == 3) {
+		analogWrite(argv[0], makeWord(argv[1], argv[2]));
+	}
+
+	return VOID_STRUCT;
+}
+
+/**
+ * @brief Check whether the ADC is taken by a background burst or a capture, which analogRead() would upset
+ * 
+ * @return True while the ADC is taken
+ */
+static bool adcBusy() {
+#ifdef USE_CAPTURE
+	if (captureLog.state == CAPTURE_ARMED || captureLog.state == CAPTURE_TRIGGERED) return true;
+#endif
+	return burst.busy;
+}
+
+/**
+ * @brief Read an analog value (0-1023) from the Arduino I/O pins
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (1)
+ * @param argv The arguments to use within the function (pin #)
+ * @return struct containing the value of pin (10-bit unsigned int contained within a uint16_t)
+ */
+struct registers analogRead(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 1 && !adcBusy()) {
+		uint16_t read_val = analogRead(argv[0]);
+		result = resultAlloc(2);
+		if (result.value == nullptr) return result;
+		result.value[0] = highByte(read_val);
+		result.value[1] = lowByte(read_val);
+	}
+
+	return result;
+}
+
+/**
+ * @brief Pick the sample encoding selected by ANALOGBURST mode bits
+ * 
+ * @param mode The ANALOGBURST mode bits
+ * @return SAMPLE_PACKED, SAMPLE_DELTA or SAMPLE_WORDS
+ */
+static uint8_t burstEncoding(uint8_t mode) {
+	if (mode & BURST_PACKED) return SAMPLE_PACKED;
+	if (mode & BURST_DELTA) return SAMPLE_DELTA;
+	return SAMPLE_WORDS;
+}
+
+/**
+ * @brief Reduce a channel's sum of 2^factor samples to its result
+ * 
+ * @param sum The sum of all samples taken on the channel
+ * @param factor The channel was sampled 2^factor times
+ * @param mode The ANALOGBURST mode bits
+ * @return The average (10 bits), or the oversampled value (10 + factor/2 bits)
+ */
+static uint16_t burstValue(uint16_t sum, uint8_t factor, uint8_t mode) {
+	if (mode & BURST_OVERSAMPLE) {
+		// Every 4x oversampling adds one bit of resolution
+		return sum >> (factor - factor / 2);
+	}
+	return sum >> factor;
+}
+
+/**
+ * @brief Encode the values of a finished burst as its mode bits ask (see SAMPLE_WORDS and following)
+ * 
+ * @param sums The sum of samples for each channel
+ * @param count The number of channels
+ * @param factor Each channel was sampled 2^factor times
+ * @param mode The ANALOGBURST mode bits
+ * @param out Where to write the encoded values, with room for sampleEncodedSize()
+ * @return The number of bytes written
+ */
+static uint8_t burstEncode(const volatile uint16_t *sums, uint8_t count, uint8_t factor, uint8_t mode, uint8_t *out) {
+	uint16_t values[ANALOG_BURST_MAX];
+	for (int i = 0; i < count; i++) {
+		values[i] = burstValue(sums[i], factor, mode);
+	}
+	return sampleEncode(values, count, burstEncoding(mode), out);
+}
+
+#if defined(USE_ADC_INTERRUPT) && defined(ADC_vect)
+/**
+ * @brief Select the input for the ADC's next conversion and start it. The reference bits are kept,
+ * so the reference chosen with analogReference() and applied by analogRead() stays in use.
+ * 
+ * @param channel The ADC channel number (not the Arduino pin number)
+ */
+static void burstConvert(uint8_t channel) {
+#if defined(MUX5)
+	ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+#endif
+	ADMUX = (ADMUX & ((1 << REFS1) | (1 << REFS0))) | (channel & 0x07);
+	ADCSRA |= (1 << ADSC) | (1 << ADIE);
+}
+#endif
+
+#if defined(USE_CAPTURE) && defined(ADC_vect)
+/**
+ * @brief Stop the ADC running freely for a capture and give it back to analogRead() and bursts
+ * 
+ * @param state The state the capture ends in
+ */
+static void captureStop(uint8_t state) {
+	ADCSRA = (ADCSRA & ~((1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0))) | capture.prescaler;
+	ADMUX &= ~(1 << ADLAR);
+	captureLog.state = state;
+}
+
+/**
+ * @brief Record one sample of a capture, watching for the trigger until it has fired
+ */
+static inline void captureSample() {
+	uint8_t sample = (capture.input != nullptr ? *capture.input : ADCH);
+	if (capture.skip > 0) {
+		capture.skip--;
+		return;
+	}
+	capture.skip = capture.divider;
+
+	// Samples are stored high byte first, so each register reads as two samples in time order
+	((volatile uint8_t *)captureLog.samples)[capture.index ^ 1] = sample;
+	capture.index++;
+
+	if (captureLog.state == CAPTURE_ARMED) {
+		bool above = (capture.input != nullptr ? (sample & capture.level) != 0 : sample >= capture.level);
+		bool fire = false;
+
+		// The trigger is only watched once the samples from before it have been taken
+		if (capture.filled < capture.pre) {
+			capture.filled++;
+		}
+		else {
+			switch (capture.mode) {
+				case CAPTURE_RISING: fire = above && !capture.above; break;
+				case CAPTURE_FALLING: fire = !above && capture.above; break;
+				case CAPTURE_ABOVE: fire = above; break;
+				case CAPTURE_BELOW: fire = !above; break;
+				default: fire = true; break;
+			}
+		}
+		capture.above = above;
+		if (!fire) return;
+
+		captureLog.state = CAPTURE_TRIGGERED;
+		capture.remaining = CAPTURE_SIZE - 1 - capture.pre;
+	}
+	else {
+		capture.remaining--;
+	}
+
+	if (capture.remaining == 0) {
+		captureStop(CAPTURE_DONE);
+	}
+}
+#endif
+
+#if defined(USE_ADC_INTERRUPT) && defined(ADC_vect)
+/**
+ * @brief Collect one conversion of a background analog burst and start the next one,
+ * or one sample of a capture while a capture is running
+ */
+ISR(ADC_vect) {
+#ifdef USE_CAPTURE
+	if (captureLog.state == CAPTURE_ARMED || captureLog.state == CAPTURE_TRIGGERED) {
+		captureSample();
+		return;
+	}
+#endif
+
+	burst.sums[burst.index] += ADC;
+
+	if (++burst.index == burst.count) {
+		burst.index = 0;
+		if (--burst.rounds == 0) {
+			ADCSRA &= ~(1 << ADIE);
+			burst.busy = false;
+			return;
+		}
+	}
+
+	burstConvert(burst.channels[burst.index]);
+}
+#endif
+
+/**
+ * @brief Sample several analog inputs in one command, averaging or oversampling each of them on the device.
+ * With BURST_ASYNC set, the conversions are driven by the ADC interrupt while Modbus traffic continues,
+ * and the values are collected later with ANALOGRESULT (only with USE_ADC_INTERRUPT; otherwise the burst does not start). BURST_PACKED or BURST_DELTA shrink the values
+ * for slow links (see SAMPLE_PACKED and SAMPLE_DELTA; tools/modmata_samples.py decodes them).
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (3-18)
+ * @param argv The arguments to use within the function (factor (2^factor samples per pin, 0-6), mode bits, pin #s)
+ * @return struct containing each pin's value (count * uint16_t, or encoded as the mode bits ask), or whether the background burst started (uint8_t)
+ */
+struct registers analogBurst(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+	if (argc < 3) {
+		return result;
+	}
+
+	uint8_t factor = argv[0];
+	uint8_t mode = argv[1];
+	uint8_t count = argc - 2;
+	if (count > ANALOG_BURST_MAX || factor > 6 || adcBusy()) {
+		return result;
+	}
+
+	// Packing keeps 10 bits, so it can't carry extra oversampled bits, and it can't be combined with deltas
+	if ((mode & BURST_PACKED) && ((mode & BURST_DELTA) || ((mode & BURST_OVERSAMPLE) && factor > 1))) {
+		return result;
+	}
+
+	if (mode & BURST_ASYNC) {
+#if defined(USE_ADC_INTERRUPT) && defined(ADC_vect)
+		// Arduino only applies analogReference() on the next analogRead(), so one read sets the reference up
+		analogRead(argv[2]);
+
+		for (int i = 0; i < count; i++) {
+			uint8_t pin = argv[i + 2];
+			if (pin >= A0) pin -= A0;
+#if defined(analogPinToChannel)
+			pin = analogPinToChannel(pin);
+#endif
+			burst.channels[i] = pin;
+			burst.sums[i] = 0;
+		}
+		burst.count = count;
+		burst.factor = factor;
+		burst.mode = mode;
+		burst.index = 0;
+		burst.rounds = 1 << factor;
+		burst.busy = true;
+		burstConvert(burst.channels[0]);
+#endif
+
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = burst.busy;
+		return result;
+	}
+
+	uint16_t sums[ANALOG_BURST_MAX] = {0};
+	for (int round = 0; round < (1 << factor); round++) {
+		for (int i = 0; i < count; i++) {
+			sums[i] += analogRead(argv[i + 2]);
+		}
+	}
+
+	result.value = (uint8_t *)arenaAlloc(sizeof(uint8_t) * sampleEncodedSize(count, burstEncoding(mode)));
+	if (result.value == nullptr) return result;
+	result.count = burstEncode(sums, count, factor, mode, result.value);
+
+	return result;
+}
+
+/**
+ * @brief Collect the values of a background analog burst started with BURST_ASYNC
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return struct containing whether the burst has finished (uint8_t), followed by each pin's value once it has (encoded as ANALOGBURST's mode bits asked)
+ */
+struct registers analogResult(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 0) {
+		bool done = !burst.busy && burst.count > 0;
+		result.value = (uint8_t *)arenaAlloc(sizeof(uint8_t) * (1 + sampleEncodedSize(burst.count, burstEncoding(burst.mode))));
+		if (result.value == nullptr) return result;
+		result.count = 1;
+		result.value[0] = done;
+		if (done) {
+			result.count += burstEncode(burst.sums, burst.count, burst.factor, burst.mode, result.value + 1);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Check that an Arduino port number refers to a port on this chip
+ * 
+ * @param port The port number (PB = 2, PC = 3, ...)
+ * @return True if the port registers exist
+ */
+static bool validPort(uint8_t port) {
+	return port != NOT_A_PORT && port <= LAST_PORT && portOutputRegister(port) != NOT_A_PORT;
+}
+
+/**
+ * @brief Set the direction of several pins on one port at once
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (3)
+ * @param argv The arguments to use within the function (port #, pin mask, direction bits (1 = output))
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers portMode(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 3) {
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+		if (validPort(argv[0])) {
+			volatile uint8_t *reg = portModeRegister(argv[0]);
+			uint8_t oldSREG = SREG;
+			cli();
+			*reg = (*reg & ~argv[1]) | (argv[2] & argv[1]);
+			SREG = oldSREG;
+			result.value[0] = 1;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Write several pins on one port in a single register write, so they all change together.
+ * Unlike digitalWrite(), this does not turn PWM off on the pins.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (3)
+ * @param argv The arguments to use within the function (port #, pin mask, values)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers portWrite(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 3) {
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+		if (validPort(argv[0])) {
+			volatile uint8_t *reg = portOutputRegister(argv[0]);
+			uint8_t oldSREG = SREG;
+			cli();
+			*reg = (*reg & ~argv[1]) | (argv[2] & argv[1]);
+			SREG = oldSREG;
+			result.value[0] = 1;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Read every pin on one port at once
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (1)
+ * @param argv The arguments to use within the function (port #)
+ * @return struct containing the input levels of the port, one bit per pin (uint8_t)
+ */
+struct registers portRead(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 1 && validPort(argv[0])) {
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = *portInputRegister(argv[0]);
+	}
+
+	return result;
+}
+
+/**
+ * @brief Look up which port and bit an Arduino pin number belongs to
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (1)
+ * @param argv The arguments to use within the function (pin #)
+ * @return struct containing the port # and the pin's bit mask (2 * uint8_t)
+ */
+struct registers portMap(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 1 && argv[0] < NUM_DIGITAL_PINS) {
+		result = resultAlloc(2);
+		if (result.value == nullptr) return result;
+		result.value[0] = digitalPinToPort(argv[0]);
+		result.value[1] = digitalPinToBitMask(argv[0]);
+	}
+
+	return result;
+}
+
+/**
+ * @brief Check that a pin number belongs to a port that can be driven directly
+ * 
+ * @param pin The Arduino pin number
+ * @return True if the pin can be used for bit-banging
+ */
+static bool bangPin(uint8_t pin) {
+	return pin < NUM_DIGITAL_PINS && digitalPinToPort(pin) != NOT_A_PIN;
+}
+
+/**
+ * @brief Drive an output straight through its port register, which is many times faster than digitalWrite().
+ * The pin's mode is left alone, so it must have been made an OUTPUT with PINMODE first.
+ * 
+ * @param out The output register of the pin's port
+ * @param mask The pin's bit in its port
+ * @param high True to drive the pin HIGH
+ */
+static void bangWrite(volatile uint8_t *out, uint8_t mask, bool high) {
+	uint8_t oldSREG = SREG;
+	cli();
+	if (high) *out |= mask;
+	else *out &= ~mask;
+	SREG = oldSREG;
+}
+
+/**
+ * @brief Clock bytes out of a data pin, one bit per clock pulse, like shiftOut() over a whole buffer.
+ * Data is set up while the clock is LOW and sampled by the peripheral on the rising edge.
+ * Both pins must already be outputs.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (5+)
+ * @param argv The arguments to use within the function (data pin #, clock pin #, bit order, clock half-period in microseconds (0 = as fast as possible), bytes)
+ * @return void (empty struct)
+ */
+struct registers shiftOut(uint8_t argc, uint8_t *argv) {
+	if (argc >= 5 && bangPin(argv[0]) && bangPin(argv[1])) {
+		volatile uint8_t *dataOut = portOutputRegister(digitalPinToPort(argv[0]));
+		uint8_t dataMask = digitalPinToBitMask(argv[0]);
+		volatile uint8_t *clockOut = portOutputRegister(digitalPinToPort(argv[1]));
+		uint8_t clockMask = digitalPinToBitMask(argv[1]);
+		bool msbFirst = (argv[2] == MSBFIRST);
+		uint8_t wait = argv[3];
+
+		for (int i = 4; i < argc; i++) {
+			for (uint8_t bit = 0; bit < 8; bit++) {
+				bangWrite(dataOut, dataMask, argv[i] & (msbFirst ? 0x80 >> bit : 0x01 << bit));
+				bangWrite(clockOut, clockMask, true);
+				if (wait) delayMicroseconds(wait);
+				bangWrite(clockOut, clockMask, false);
+				if (wait) delayMicroseconds(wait);
+			}
+		}
+	}
+
+	return VOID_STRUCT;
+}
+
+/**
+ * @brief Clock bytes in from a data pin, one bit per clock pulse, like shiftIn() over a whole buffer.
+ * Each bit is read while the clock is HIGH. The clock pin must already be an output and the data pin an input.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (5)
+ * @param argv The arguments to use within the function (data pin #, clock pin #, bit order, clock half-period in microseconds (0 = as fast as possible), byte count (1 to MAX_ARGC))
+ * @return struct containing the bytes read (count * uint8_t)
+ */
+struct registers shiftIn(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 5 && bangPin(argv[0]) && bangPin(argv[1]) && argv[4] > 0 && argv[4] <= MAX_ARGC) {
+		volatile uint8_t *dataIn = portInputRegister(digitalPinToPort(argv[0]));
+		uint8_t dataMask = digitalPinToBitMask(argv[0]);
+		volatile uint8_t *clockOut = portOutputRegister(digitalPinToPort(argv[1]));
+		uint8_t clockMask = digitalPinToBitMask(argv[1]);
+		bool msbFirst = (argv[2] == MSBFIRST);
+		uint8_t wait = argv[3];
+
+		result = resultAlloc(argv[4]);
+		if (result.value == nullptr) return result;
+
+		for (int i = 0; i < result.count; i++) {
+			uint8_t value = 0;
+			for (uint8_t bit = 0; bit < 8; bit++) {
+				bangWrite(clockOut, clockMask, true);
+				if (wait) delayMicroseconds(wait);
+				if (*dataIn & dataMask) {
+					value |= (msbFirst ? 0x80 >> bit : 0x01 << bit);
+				}
+				bangWrite(clockOut, clockMask, false);
+				if (wait) delayMicroseconds(wait);
+			}
+			result.value[i] = value;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Wait for a number of microseconds. delayMicroseconds() is only accurate up to 16383,
+ * so the whole milliseconds of longer waits are made with delay()
+ * 
+ * @param us The length of the wait in microseconds
+ */
+static void waitMicroseconds(uint16_t us) {
+	if (us > 16383) {
+		delay(us / 1000);
+		us %= 1000;
+	}
+	delayMicroseconds(us);
+}
+
+/**
+ * @brief Measure the length of a pulse, like pulseIn(). An optional trigger pulse is sent first, so that
+ * sensors which answer a trigger with an echo (ultrasonic rangers) can be read in one command without
+ * missing the start of the echo. The timeout is capped at PULSE_MAX_US, so the host can't hold up
+ * the connection for longer than that.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (6 or 9)
+ * @param argv The arguments to use within the function (pin #, level of the pulse, 32-bit timeout in microseconds (0 = PULSE_MAX_US),
+ * [16-bit trigger length in microseconds, trigger pin #])
+ * @return struct containing the length of the pulse in microseconds, or 0 if it timed out (uint32_t)
+ */
+struct registers pulseIn(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if ((argc == 6 || argc == 9) && bangPin(argv[0]) && (argc == 6 || bangPin(argv[8]))) {
+		unsigned long timeout = makeDWord(argv[2], argv[3], argv[4], argv[5]);
+		if (timeout == 0 || timeout > PULSE_MAX_US) timeout = PULSE_MAX_US;
+
+		if (argc == 9) {
+			volatile uint8_t *trigOut = portOutputRegister(digitalPinToPort(argv[8]));
+			uint8_t trigMask = digitalPinToBitMask(argv[8]);
+			bangWrite(trigOut, trigMask, true);
+			waitMicroseconds(makeWord(argv[6], argv[7]));
+			bangWrite(trigOut, trigMask, false);
+		}
+
+		unsigned long width = pulseIn(argv[0], argv[1], timeout);
+		result = resultAlloc(4);
+		if (result.value == nullptr) return result;
+		result.value[0] = (width >> 24) & 0xFF;
+		result.value[1] = (width >> 16) & 0xFF;
+		result.value[2] = (width >> 8) & 0xFF;
+		result.value[3] = width & 0xFF;
+	}
+
+	return result;
+}
+
+/**
+ * @brief Send a train of pulses on an output pin. The reply is sent once the whole train is finished,
+ * so trains that would take longer than PULSE_MAX_US are refused rather than holding up the connection.
+ * The pin must already be an output, and is left at the idle level (the opposite of the pulse level).
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (8)
+ * @param argv The arguments to use within the function (pin #, level of the pulses, 16-bit pulse count, 16-bit pulse length and 16-bit gap in microseconds)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers pulseOut(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 8) {
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+
+		uint16_t count = makeWord(argv[2], argv[3]);
+		uint16_t width = makeWord(argv[4], argv[5]);
+		uint16_t gap = makeWord(argv[6], argv[7]);
+		if (!bangPin(argv[0]) || (uint32_t)count * width + (count > 0 ? (uint32_t)(count - 1) * gap : 0) > PULSE_MAX_US) {
+			return result;
+		}
+
+		volatile uint8_t *out = portOutputRegister(digitalPinToPort(argv[0]));
+		uint8_t mask = digitalPinToBitMask(argv[0]);
+		bool level = (argv[1] != LOW);
+		for (uint16_t i = 0; i < count; i++) {
+			bangWrite(out, mask, level);
+			waitMicroseconds(width);
+			bangWrite(out, mask, !level);
+			if (i + 1 < count) waitMicroseconds(gap);
+		}
+		result.value[0] = 1;
+	}
+
+	return result;
+}
+
+#ifdef USE_CAPTURE
+/**
+ * @brief Record an analog input or a port at a fixed rate around a trigger, for transients that are too
+ * fast to see by polling. The ADC runs freely and each conversion is one sample period, at
+ * F_CPU / (13 * 2^prescaler * (divider + 1)) samples per second (76.9k with prescaler 4 at 16MHz).
+ * Analog samples keep the top 8 bits. Once the trigger fires, the samples from before it are kept
+ * and the rest of the CAPTURE_SIZE samples are taken after it. The host follows the state and reads the samples
+ * from the capture input registers (see capture_log). analogRead() and ANALOGBURST wait until the capture ends.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (7, or 0 to cancel)
+ * @param argv The arguments to use within the function (source, pin # (CAPTURE_ANALOG) or port # (CAPTURE_PORT), trigger mode,
+ * threshold (CAPTURE_ANALOG) or trigger pin mask (CAPTURE_PORT), samples before the trigger, ADC prescaler (4-7), divider)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers captureStart(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+	result = resultAlloc(1);
+	if (result.value == nullptr) return result;
+	result.value[0] = 0;
+
+#if defined(ADC_vect)
+	if (argc == 0) {
+		noInterrupts();
+		if (captureLog.state == CAPTURE_ARMED || captureLog.state == CAPTURE_TRIGGERED) {
+			captureStop(CAPTURE_IDLE);
+		}
+		interrupts();
+		result.value[0] = 1;
+		return result;
+	}
+
+	uint8_t source = argv[0];
+	if (argc != 7 || adcBusy() || argv[2] > CAPTURE_BELOW || argv[5] < 4 || argv[5] > 7) {
+		return result;
+	}
+
+	uint8_t channel = 0;
+	if (source == CAPTURE_ANALOG) {
+		channel = argv[1];
+		if (channel >= A0) channel -= A0;
+#if defined(analogPinToChannel)
+		channel = analogPinToChannel(channel);
+#endif
+		capture.input = nullptr;
+	}
+	else if (source == CAPTURE_PORT && validPort(argv[1])) {
+		capture.input = portInputRegister(argv[1]);
+	}
+	else {
+		return result;
+	}
+
+	// Arduino only applies analogReference() on the next analogRead(), so one read sets the reference up
+	if (capture.input == nullptr) analogRead(argv[1]);
+
+	capture.level = argv[3];
+	capture.mode = argv[2];
+	capture.pre = argv[4];
+	capture.index = 0;
+	capture.filled = 0;
+	capture.remaining = 0;
+	capture.divider = argv[6];
+	capture.skip = 0;
+	capture.above = false;
+	capture.prescaler = ADCSRA & ((1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0));
+	captureLog.trigger = capture.pre;
+	captureLog.state = CAPTURE_ARMED;
+
+	// Free running, left adjusted so ADCH holds the top 8 bits
+#if defined(MUX5)
+	ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+#endif
+#if defined(ADTS3)
+	ADCSRB &= ~(1 << ADTS3);
+#endif
+	ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));
+	ADMUX = (ADMUX & ((1 << REFS1) | (1 << REFS0))) | (1 << ADLAR) | (channel & 0x07);
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIF) | (1 << ADIE) | argv[5];
+	result.value[0] = 1;
+#endif
+
+	return result;
+}
+
+/**
+ * @brief Put the samples of a finished capture in time order before they are read, so that the trigger
+ * sample is at the position given in the trigger register
+ * 
+ * @param offset The first capture register being read
+ * @param numregs The number of capture registers being read
+ */
+void captureRead(word offset, word numregs) {
+	if (captureLog.state != CAPTURE_DONE || capture.index == 0) return;
+
+	// Rotate the ring so the oldest sample comes first, by reversing both parts and then the whole
+	uint8_t *bytes = (uint8_t *)captureLog.samples;
+	uint16_t parts[3][2] = {{0, capture.index}, {capture.index, CAPTURE_SIZE}, {0, CAPTURE_SIZE}};
+	for (int i = 0; i < 3; i++) {
+		for (uint16_t from = parts[i][0], to = parts[i][1]; from + 1 < to; from++, to--) {
+			uint8_t sample = bytes[from ^ 1];
+			bytes[from ^ 1] = bytes[(to - 1) ^ 1];
+			bytes[(to - 1) ^ 1] = sample;
+		}
+	}
+	capture.index = 0;
+}
+#endif
+
+#ifdef USE_NATIVE_IO
+/**
+ * @brief Fill in the coils being read with the level each pin is driven to. The port registers are
+ * read directly, since digitalRead() would turn off PWM on the pin.
+ * 
+ * @param offset The first coil being read, counted from IO_FIRST_COIL
+ * @param numregs The number of pins being read
+ */
+void ioOutputsRead(word offset, word numregs) {
+	for (word pin = IO_FIRST_COIL + offset; pin < IO_FIRST_COIL + offset + numregs; pin++) {
+		uint8_t port = digitalPinToPort(pin);
+		bool high = port != NOT_A_PIN && (*portOutputRegister(port) & digitalPinToBitMask(pin));
+		ioPins[pin] = (high ? 0xFF00 : 0x0000);
+	}
+}
+
+/**
+ * @brief Fill in the discrete inputs being read with the level on each pin
+ * 
+ * @param offset The first pin being read
+ * @param numregs The number of pins being read
+ */
+void ioInputsRead(word offset, word numregs) {
+	for (word pin = offset; pin < offset + numregs; pin++) {
+		uint8_t port = digitalPinToPort(pin);
+		bool high = port != NOT_A_PIN && (*portInputRegister(port) & digitalPinToBitMask(pin));
+		ioPins[pin] = (high ? 0xFF00 : 0x0000);
+	}
+}
+
+/**
+ * @brief Drive a pin when a master writes its coil, making it an output first. The serial pins
+ * have no coils, so writes to them are refused with an illegal address exception.
+ * 
+ * @param offset The coil being written, counted from IO_FIRST_COIL
+ * @param value The coil's new value (0xFF00 = HIGH, 0x0000 = LOW)
+ */
+void ioCoilWrite(word offset, word value) {
+	uint8_t pin = IO_FIRST_COIL + offset;
+	pinMode(pin, OUTPUT);
+	digitalWrite(pin, (uint8_t)(value ? HIGH : LOW));
+}
+
+/**
+ * @brief Sample the analog inputs whose input registers are being read
+ * 
+ * @param offset The first analog input being read
+ * @param numregs The number of analog inputs being read
+ */
+void ioAnalogRead(word offset, word numregs) {
+	// Keep the last values while the ADC is taken
+	if (adcBusy()) return;
+
+	for (word channel = offset; channel < offset + numregs; channel++) {
+		ioAnalog[channel] = analogRead(channel);
+	}
+}
+#endif
+
+#ifdef USE_PIN_EVENTS
+/**
+ * @brief Queue an event for every watched pin whose level has changed. Runs from the external
+ * and pin change interrupts, which can each cover several watched pins.
+ */
+static void eventScan() {
+	unsigned long now = micros();
+
+	for (int i = 0; i < EVENT_PINS; i++) {
+		volatile struct event_pin *source = &eventPins[i];
+		if (source->mode == EVENT_OFF) continue;
+
+		uint8_t level = (*source->input & source->bit) ? HIGH : LOW;
+		if (level == source->level) continue;
+		source->level = level;
+		if ((source->mode == EVENT_RISING && level == LOW) || (source->mode == EVENT_FALLING && level == HIGH)) continue;
+
+		uint8_t next = (eventHead + 1) % EVENT_QUEUE_SIZE;
+		if (next == eventTail) {
+			eventsDropped++;
+			continue;
+		}
+		eventQueue[eventHead].pin = source->pin;
+		eventQueue[eventHead].level = level;
+		eventQueue[eventHead].time = now;
+		eventHead = next;
+	}
+}
+
+#if defined(PCINT0_vect)
+/**
+ * @brief Pin change interrupts for the watched pins without an external interrupt
+ */
+ISR(PCINT0_vect) {
+	eventScan();
+}
+#endif
+#if defined(PCINT1_vect)
+ISR(PCINT1_vect) {
+	eventScan();
+}
+#endif
+#if defined(PCINT2_vect)
+ISR(PCINT2_vect) {
+	eventScan();
+}
+#endif
+#if defined(PCINT3_vect)
+ISR(PCINT3_vect) {
+	eventScan();
+}
+#endif
+
+/**
+ * @brief Enable the interrupt that reports changes of a pin, preferring its external interrupt
+ * 
+ * @param pin The Arduino pin number
+ * @return False if the pin has neither an external nor a pin change interrupt
+ */
+static bool eventArm(uint8_t pin) {
+	if (digitalPinToInterrupt(pin) != NOT_AN_INTERRUPT) {
+		attachInterrupt(digitalPinToInterrupt(pin), eventScan, CHANGE);
+		return true;
+	}
+#if defined(PCICR)
+	if (digitalPinToPCICR(pin) != nullptr) {
+		*digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+		*digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+		return true;
+	}
+#endif
+	return false;
+}
+
+/**
+ * @brief Disable the interrupt enabled by eventArm()
+ * 
+ * @param pin The Arduino pin number
+ */
+static void eventDisarm(uint8_t pin) {
+	if (digitalPinToInterrupt(pin) != NOT_AN_INTERRUPT) {
+		detachInterrupt(digitalPinToInterrupt(pin));
+		return;
+	}
+#if defined(PCICR)
+	if (digitalPinToPCICR(pin) != nullptr) {
+		*digitalPinToPCMSK(pin) &= ~_BV(digitalPinToPCMSKbit(pin));
+	}
+#endif
+}
+
+/**
+ * @brief Watch a pin for changes, so the host can read them from the event input registers instead of
+ * polling DIGITALREAD. Changes are caught by interrupts and queued with a timestamp, so short pulses are not missed.
+ * The pin's mode is left as it is, so set it with PINMODE first (e.g. INPUT_PULLUP for a button).
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (2)
+ * @param argv The arguments to use within the function (pin #, mode (EVENT_OFF/CHANGE/RISING/FALLING))
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers pinEvent(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 2) {
+		uint8_t pin = argv[0];
+		uint8_t mode = argv[1];
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+		if (pin >= NUM_DIGITAL_PINS || mode > EVENT_FALLING) {
+			return result;
+		}
+
+		// Stop watching the pin before its slot is changed or reused
+		int slot = -1;
+		for (int i = 0; i < EVENT_PINS; i++) {
+			if (eventPins[i].mode != EVENT_OFF && eventPins[i].pin == pin) {
+				eventPins[i].mode = EVENT_OFF;
+				eventDisarm(pin);
+				slot = i;
+			}
+		}
+		if (mode == EVENT_OFF) {
+			result.value[0] = 1;
+			return result;
+		}
+
+		for (int i = 0; i < EVENT_PINS && slot < 0; i++) {
+			if (eventPins[i].mode == EVENT_OFF) slot = i;
+		}
+		if (slot < 0) {
+			return result;
+		}
+
+		// The slot is filled in before its mode is set, so the interrupt never sees it half written
+		volatile struct event_pin *source = &eventPins[slot];
+		source->pin = pin;
+		source->bit = digitalPinToBitMask(pin);
+		source->input = portInputRegister(digitalPinToPort(pin));
+		source->level = (*source->input & source->bit) ? HIGH : LOW;
+		source->mode = mode;
+
+		if (eventArm(pin)) {
+			result.value[0] = 1;
+		} else {
+			source->mode = EVENT_OFF;
+		}
+	}
+
+	return result;
 }
 
 /**
- * @brief Read a digital value (HIGH/LOW) from the Arduino I/O pins
+ * @brief Fill in the event input registers as the host reads them. Events are only taken off the queue
+ * when the read covers the start of the event window, so reading the pending count alone loses nothing.
  * 
- * @param argc The number of arguments contained within the 'argv' array (1)
- * @param argv The arguments to use within the function (pin #)
- * @return struct containing the value of pin (1 uint8_t)
+ * @param offset The first event register being read
+ * @param numregs The number of event registers being read
  */
-struct registers digitalRead(uint8_t argc, uint8_t *argv) {
-	struct registers result{VOID_STRUCT};
+void eventDrain(word offset, word numregs) {
+	uint8_t tail = eventTail;
+	uint8_t pending = (uint8_t)(eventHead - tail) % EVENT_QUEUE_SIZE;
+	uint8_t count = 0;
 
-	if (argc == 1) {
-		uint8_t read_val = digitalRead(argv[0]);
-		result.count = 1;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t));
-		result.value[0] = read_val;
+	if (offset <= EVENT_FIRST && offset + numregs > EVENT_FIRST) {
+		count = min(pending, (offset + numregs - EVENT_FIRST) / 3);
+		for (int i = 0; i < count; i++) {
+			volatile struct pin_event *event = &eventQueue[(tail + i) % EVENT_QUEUE_SIZE];
+			word *regs = eventRegisters + EVENT_FIRST + i * 3;
+			regs[0] = makeWord(event->pin, event->level);
+			regs[1] = event->time >> 16;
+			regs[2] = event->time & 0xFFFF;
+		}
+		eventTail = (tail + count) % EVENT_QUEUE_SIZE;
 	}
 
-	return result;
+	eventRegisters[EVENT_PENDING] = pending - count;
+	eventRegisters[EVENT_COUNT] = count;
+	noInterrupts();
+	eventRegisters[EVENT_DROPPED] = eventsDropped;
+	interrupts();
 }
+#endif
+#endif
 
+#ifdef USE_SERVO
 /**
- * @brief Write an analog value (0-255) to the Arduino I/O pins
+ * @brief Find the pool slot of an attached servo
  * 
- * @param argc The number of arguments contained within the 'argv' array (3)
- * @param argv The arguments to use within the function (pin #, 16-bit value split into 2 8-bit values)
- * @return void (empty struct)
+ * @param pin The pin the servo is attached to
+ * @return The slot, or nullptr if no servo is attached to the pin
  */
-struct registers analogWrite(uint8_t argc, uint8_t *argv) {
-	if (argc == 3) {
-		analogWrite(argv[0], makeWord(argv[1], argv[2]));
+static struct servo_slot *servoFind(uint8_t pin) {
+	for (int i = 0; i < SERVO_POOL_SIZE; i++) {
+		if (servos[i].used && servos[i].pin == pin) {
+			return &servos[i];
+		}
 	}
-
-	return VOID_STRUCT;
+	return nullptr;
 }
 
 /**
- * @brief Read an analog value (0-1023) from the Arduino I/O pins
+ * @brief Move a pooled servo to a position given in millidegrees
  * 
- * @param argc The number of arguments contained within the 'argv' array (1)
- * @param argv The arguments to use within the function (pin #)
- * @return struct containing the value of pin (10-bit unsigned int contained within a uint16_t)
+ * @param slot The servo's pool slot
+ * @param position The position to write (millidegrees)
  */
-struct registers analogRead(uint8_t argc, uint8_t *argv) {
-	struct registers result{VOID_STRUCT};
-
-	if (argc == 1) {
-		uint16_t read_val = analogRead(argv[0]);
-		result.count = 2;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t) * 2);
-		result.value[0] = highByte(read_val);
-		result.value[1] = lowByte(read_val);
-	}
-
-	return result;
+static void servoSet(struct servo_slot *slot, int32_t position) {
+	slot->position = position;
+	slot->servo->writeMicroseconds(map(position, 0, 180000L, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH));
 }
 
 /**
@@ -126,11 +1136,23 @@ struct registers servoAttach(uint8_t argc, uint8_t *argv) {
 
 	if (argc == 1) {
 		int pin = argv[0];
-		result.count = 1;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t));
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
 		result.value[0] = 0;
-		if (pin >= 0 && pin <= 13 && servo_count < MAX_SERVOS) {
-			result.value[0] = servos[pin].attach(pin);
+
+		struct servo_slot *slot = servoFind(pin);
+		for (int i = 0; slot == nullptr && i < SERVO_POOL_SIZE; i++) {
+			if (!servos[i].used) slot = &servos[i];
+		}
+
+		if (slot != nullptr) {
+			// Servo objects claim a timer channel for good when constructed, so they are only created once
+			if (slot->servo == nullptr) slot->servo = new Servo();
+			slot->pin = pin;
+			slot->used = true;
+			slot->moving = false;
+			result.value[0] = slot->servo->attach(pin);
+			slot->position = slot->servo->read() * 1000L;
 		}
 	}
 
@@ -147,12 +1169,14 @@ struct registers servoAttach(uint8_t argc, uint8_t *argv) {
 struct registers servoDetach(uint8_t argc, uint8_t *argv) {
 	struct registers result{VOID_STRUCT};
 	if (argc == 1) {
-		int pin = argv[0];
-		result.count = 1;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t));
+		struct servo_slot *slot = servoFind(argv[0]);
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
 		result.value[0] = 0;
-		if (pin >= 0 && pin <= 13) {
-			servos[pin].detach();
+		if (slot != nullptr) {
+			slot->servo->detach();
+			slot->used = false;
+			slot->moving = false;
 			result.value[0] = 1;
 		}
 	}
@@ -161,7 +1185,7 @@ struct registers servoDetach(uint8_t argc, uint8_t *argv) {
 }
 
 /**
- * @brief Write a value to the connected servo
+ * @brief Write a value to the connected servo, stopping any move in progress
  * 
  * @param argc The number of arguments contained within the 'argv' array (2)
  * @param argv The arguments to use within the function (pin #, value)
@@ -170,13 +1194,15 @@ struct registers servoDetach(uint8_t argc, uint8_t *argv) {
 struct registers servoWrite(uint8_t argc, uint8_t *argv) {
 	struct registers result{VOID_STRUCT};
 	if(argc == 2) {
-		int pin = argv[0];
+		struct servo_slot *slot = servoFind(argv[0]);
 		int angle = argv[1];
-		result.count = 1;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t));
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
 		result.value[0] = 0;
-		if (pin >= 0 && pin <= 13) {
-			servos[pin].write(angle);
+		if (slot != nullptr) {
+			slot->moving = false;
+			slot->servo->write(angle);
+			slot->position = slot->servo->read() * 1000L;
 			result.value[0] = 1;
 		}
 	}
@@ -189,22 +1215,113 @@ struct registers servoWrite(uint8_t argc, uint8_t *argv) {
  * 
  * @param argc The number of arguments contained within the 'argv' array
  * @param argv The arguments to use within the function
- * @return struct containing the last value written to the servo (uint8_t)
+ * @return struct containing the current position of the servo, including part way through a move (uint8_t)
  */
 struct registers servoRead(uint8_t argc, uint8_t *argv) {
 	struct registers result{VOID_STRUCT};
 	if (argc == 1) {
-		int pin = argv[0];
-		if (pin >= 0 && pin <= 13) {
-			result.count = 1;
-			result.value = (uint8_t *)malloc(sizeof(uint8_t));
-			result.value[0] = servos[pin].read();
+		struct servo_slot *slot = servoFind(argv[0]);
+		if (slot != nullptr) {
+			result = resultAlloc(1);
+			if (result.value == nullptr) return result;
+			result.value[0] = slot->servo->read();
 		}
 	}
 	
 	return result;
 }
 
+/**
+ * @brief Move one or more servos along a trapezoidal speed profile that is run on the device.
+ * When several servos are given, their speeds are scaled so that they all arrive at the same time,
+ * the one with the longest travel using the full velocity and acceleration.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (6+, even)
+ * @param argv The arguments to use within the function (16-bit velocity (deg/s), 16-bit acceleration (deg/s^2, 0 = none), then pin #, angle for each servo)
+ * @return struct containing the number of servos set in motion (uint8_t)
+ */
+struct registers servoMove(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc >= 6 && argc % 2 == 0) {
+		int32_t velocity = makeWord(argv[0], argv[1]) * 1000L;
+		int32_t acceleration = makeWord(argv[2], argv[3]) * 1000L;
+
+		// The longest travel sets the pace for everyone else
+		int32_t longest = 0;
+		for (int i = 4; i < argc; i += 2) {
+			struct servo_slot *slot = servoFind(argv[i]);
+			if (slot != nullptr) {
+				longest = max(longest, labs(min(argv[i + 1], 180) * 1000L - slot->position));
+			}
+		}
+
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+
+		for (int i = 4; i < argc && velocity > 0; i += 2) {
+			struct servo_slot *slot = servoFind(argv[i]);
+			if (slot == nullptr) continue;
+
+			slot->target = min(argv[i + 1], 180) * 1000L;
+			int32_t distance = labs(slot->target - slot->position);
+			if (distance == 0) continue;
+
+			slot->maxVelocity = max((int64_t)velocity * distance / longest, 1);
+			slot->acceleration = (int64_t)acceleration * distance / longest;
+			slot->velocity = (slot->acceleration == 0 ? slot->maxVelocity : 0);
+			slot->moving = true;
+			result.value[0]++;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Advance every servo that is part way through a SERVOMOVE. Run from Modmata.available(),
+ * it only does work once every SERVO_TICK_MS.
+ */
+void servoUpdate() {
+	static unsigned long lastTick = 0;
+	unsigned long now = millis();
+	if (now - lastTick < SERVO_TICK_MS) return;
+
+	// Don't jump ahead after a long stall in loop()
+	int32_t dt = min(now - lastTick, 100UL);
+	lastTick = now;
+
+	for (int i = 0; i < SERVO_POOL_SIZE; i++) {
+		struct servo_slot *slot = &servos[i];
+		if (!slot->used || !slot->moving) continue;
+
+		int32_t remaining = labs(slot->target - slot->position);
+		if (slot->acceleration > 0) {
+			int32_t dv = (slot->acceleration / 10) * dt / 100;
+
+			// Brake once the stopping distance v^2 / 2a reaches the remaining travel
+			if ((int64_t)slot->velocity * slot->velocity >= 2 * (int64_t)slot->acceleration * remaining) {
+				slot->velocity = max(slot->velocity - dv, min(slot->maxVelocity, 1000L));
+			}
+			else {
+				slot->velocity = min(slot->velocity + dv, slot->maxVelocity);
+			}
+		}
+
+		int32_t step = max((slot->velocity / 10) * dt / 100, 1);
+		if (step >= remaining) {
+			slot->moving = false;
+			servoSet(slot, slot->target);
+		}
+		else {
+			servoSet(slot, slot->position + (slot->target > slot->position ? step : -step));
+		}
+	}
+}
+#endif
+
+#ifdef USE_WIRE
 /**
  * @brief Begin an I2C connection between the Arduino and a peripheral
  * 
@@ -214,6 +1331,7 @@ struct registers servoRead(uint8_t argc, uint8_t *argv) {
  */
 struct registers wireBegin(uint8_t argc, uint8_t *argv) {
 	Wire.begin();
+	wireActive = true;
 	return VOID_STRUCT;
 }
 
@@ -226,6 +1344,7 @@ struct registers wireBegin(uint8_t argc, uint8_t *argv) {
  */
 struct registers wireEnd(uint8_t argc, uint8_t *argv) {
 	Wire.end();
+	wireActive = false;
 	return VOID_STRUCT;
 }
 
@@ -285,7 +1404,8 @@ struct registers wireRead(uint8_t argc, uint8_t *argv) {
 		uint8_t addr = argv[0];
 		uint8_t reg = argv[1];
 		uint8_t num_bytes = argv[2];
-		result.value = (uint8_t *)calloc(num_bytes, sizeof(uint8_t));
+		result.value = (uint8_t *)arenaAlloc(sizeof(uint8_t) * num_bytes);
+		if (result.value == nullptr) return result;
 		
 		Wire.beginTransmission(addr);
 		Wire.write(reg);
@@ -303,6 +1423,180 @@ struct registers wireRead(uint8_t argc, uint8_t *argv) {
 	return result;	
 }
 
+/**
+ * @brief Run a list of I2C operations, possibly on several peripherals, in one command.
+ * List format, one operation after another:
+ * - WIRE_OP_WRITE | addr | count | bytes          (write, then STOP)
+ * - WIRE_OP_READ  | addr | count | bytes | length (write, repeated START, read length bytes, then STOP)
+ * - WIRE_OP_DELAY | ms
+ * 
+ * A read with no bytes to write skips straight to the read. Writes and reads are limited to BUFFER_LENGTH bytes,
+ * and a list with a longer one is refused as a whole. The list stops at the first operation
+ * that is not acknowledged or returns too few bytes.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array
+ * @param argv The arguments to use within the function (operation list)
+ * @return struct containing the number of operations completed (uint8_t), followed by the bytes of every read in order
+ */
+struct registers wireBatch(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	// Check the list is well formed, that every write and read fits in the Wire buffer, and add up how much will be read,
+	// so a bad list is refused before anything goes out on the bus
+	int total = 0;
+	int i = 0;
+	while (i < argc) {
+		if (argv[i] == WIRE_OP_DELAY && i + 1 < argc) {
+			i += 2;
+		}
+		else if (argv[i] == WIRE_OP_WRITE && i + 2 < argc && i + 3 + argv[i + 2] <= argc && argv[i + 2] <= BUFFER_LENGTH) {
+			i += 3 + argv[i + 2];
+		}
+		else if (argv[i] == WIRE_OP_READ && i + 2 < argc && i + 4 + argv[i + 2] <= argc && argv[i + 2] <= BUFFER_LENGTH
+			&& argv[i + 3 + argv[i + 2]] <= BUFFER_LENGTH) {
+			total += argv[i + 3 + argv[i + 2]];
+			i += 4 + argv[i + 2];
+		}
+		else {
+			return result;
+		}
+	}
+	if (1 + total > MAX_ARGC) {
+		return result;
+	}
+
+	result = resultAlloc(1 + total);
+	if (result.value == nullptr) return result;
+	memset(result.value, 0, result.count);
+
+	uint8_t *read = result.value + 1;
+	for (i = 0; i < argc; ) {
+		uint8_t op = argv[i];
+		if (op == WIRE_OP_DELAY) {
+			delay(argv[i + 1]);
+			i += 2;
+			result.value[0]++;
+			continue;
+		}
+
+		uint8_t addr = argv[i + 1];
+		uint8_t count = argv[i + 2];
+		const uint8_t *bytes = argv + i + 3;
+		i += 3 + count;
+
+		if (op == WIRE_OP_WRITE || count > 0) {
+			Wire.beginTransmission(addr);
+			Wire.write(bytes, count);
+			if (Wire.endTransmission(op == WIRE_OP_WRITE) != 0) break;
+		}
+
+		if (op == WIRE_OP_READ) {
+			uint8_t length = argv[i++];
+			if (Wire.requestFrom(addr, length) != length) break;
+			for (int j = 0; j < length; j++) {
+				*read++ = Wire.read();
+			}
+		}
+
+		result.value[0]++;
+	}
+
+	return result;
+}
+
+#ifndef USE_HOLDING_REGISTERS_ONLY
+/**
+ * @brief Have an I2C register block read in the background and cached in input registers, so the host
+ * can fetch the latest value with a single read instead of waiting on the I2C bus.
+ * Each slot's input registers are: status (flags << 8 | length), time of the last good read (2 words),
+ * then the data bytes packed two per register. The cache starts with the device clock (2 words).
+ * Polling works whether the bus was begun with WIREBEGIN or by the sketch; if it hasn't been begun, this begins it.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (6)
+ * @param argv The arguments to use within the function (slot #, addr, reg, num_bytes (0 = stop), 16-bit period (ms))
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers wirePoll(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 6) {
+		uint8_t slot = argv[0];
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+
+		if (slot < WIRE_POLL_SLOTS && argv[3] <= WIRE_POLL_MAX_LEN) {
+			// The sketch may have begun the bus with Wire.begin(), which WIREBEGIN never sees. Only a bus
+			// that is still off is begun here, so a clock set up by the sketch is kept
+			if (!wireActive) {
+#if defined(TWCR)
+				if (!(TWCR & (1 << TWEN))) Wire.begin();
+#else
+				Wire.begin();
+#endif
+				wireActive = true;
+			}
+
+			polls[slot].addr = argv[1];
+			polls[slot].reg = argv[2];
+			polls[slot].length = argv[3];
+			polls[slot].period = makeWord(argv[4], argv[5]);
+			polls[slot].last = millis() - polls[slot].period;
+
+			// Clear the old values so the host can't mistake them for the new read
+			word *regs = wirePollRegisters + 2 + slot * WIRE_POLL_STRIDE;
+			memset(regs, 0, WIRE_POLL_STRIDE * sizeof(word));
+			regs[0] = argv[3];
+			result.value[0] = 1;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Refresh one background I2C read that is due. Run from Modmata.available(); only one
+ * read is made per call so a loop iteration never waits on more than one transaction.
+ */
+void wirePollUpdate() {
+	static uint8_t next = 0;
+	unsigned long now = millis();
+
+	wirePollRegisters[0] = now >> 16;
+	wirePollRegisters[1] = now & 0xFFFF;
+
+	// A bulk I2C read holds the bus without a STOP, and a poll in between would break it
+	if (!wireActive || bulk.bus == BULK_WIRE) return;
+
+	for (int i = 0; i < WIRE_POLL_SLOTS; i++) {
+		struct wire_poll *poll = &polls[next];
+		word *regs = wirePollRegisters + 2 + next * WIRE_POLL_STRIDE;
+		next = (next + 1) % WIRE_POLL_SLOTS;
+
+		if (poll->length == 0 || now - poll->last < poll->period) continue;
+		poll->last = now;
+
+		Wire.beginTransmission(poll->addr);
+		Wire.write(poll->reg);
+		if (Wire.endTransmission(false) != 0 || Wire.requestFrom(poll->addr, poll->length) != poll->length) {
+			regs[0] = makeWord(highByte(regs[0]) | WIRE_POLL_FAILED, poll->length);
+			return;
+		}
+
+		for (int j = 0; j < poll->length; j++) {
+			uint8_t data = Wire.read();
+			regs[3 + j / 2] = (j % 2 == 0 ? makeWord(data, 0) : regs[3 + j / 2] | data);
+		}
+		regs[0] = makeWord(WIRE_POLL_VALID, poll->length);
+		regs[1] = now >> 16;
+		regs[2] = now & 0xFFFF;
+		return;
+	}
+}
+#endif
+#endif
+
+#ifdef USE_SPI
 /**
  * @brief Begin a SPI connection between the Arduino and a peripheral
  * 
@@ -340,30 +1634,41 @@ struct registers spiSettings(uint8_t argc, uint8_t *argv) {
 }
 
 /**
- * @brief Exchange data over the SPI connection (Read + Write)
+ * @brief Check that the SPI bus isn't held by an open bulk transfer, whose chip select stays low between chunks
+ * 
+ * @return True if other SPI traffic can use the bus
+ */
+static bool spiBusFree() {
+#ifdef USE_BULK
+	return bulk.bus != BULK_SPI;
+#else
+	return true;
+#endif
+}
+
+/**
+ * @brief Exchange data over the SPI connection (Read + Write). Refused while a bulk transfer holds the bus.
  * 
  * @param argc The number of arguments contained within the 'argv' array
  * @param argv The arguments to use within the function
- * @return struct containing the response to the command written (argc - 1 * uint8_t)
+ * @return struct containing the response to the command written (argc - 1 * uint8_t), exchanged in place in argv
  */
 struct registers spiTransferBuf(uint8_t argc, uint8_t *argv) {
 	// Register format:
-	// | CMD/ARGC | Bytes                 |
-	// |<-1 word->|<-31 words / 62 bytes->|
+	// | CMD/ARGC | CS pin  | Bytes                             |
+	// |<-1 word->|<-1 byte->|<-up to MAX_ARGC - 1 (197) bytes->|
 
 	struct registers result{VOID_STRUCT};
 	
-	if (argc > 1) {
+	if (argc > 1 && spiBusFree()) {
 		uint8_t CS_pin = argv[0];
 
 		result.count = argc - 1;
-		result.value = (uint8_t *)malloc(sizeof(uint8_t) * result.count);
+		result.value = argv + 1;
 		
 		SPI.beginTransaction(SPISettings(settings.speed, settings.order, settings.mode));
 		digitalWrite((uint8_t)CS_pin, (uint8_t)LOW);
-		for(int i = 1; i < argc; i++) {
-			result.value[i-1] = SPI.transfer(argv[i]);
-		}
+		SPI.transfer(result.value, result.count);
 		digitalWrite((uint8_t)CS_pin, (uint8_t)HIGH);
 		SPI.endTransaction();
 	}
@@ -372,7 +1677,99 @@ struct registers spiTransferBuf(uint8_t argc, uint8_t *argv) {
 }
 
 /**
- * @brief End a SPI connection between the Arduino and a peripheral
+ * @brief Register a SPI peripheral under a session #, so that its settings and chip select
+ * are worked out once instead of on every exchange
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (8)
+ * @param argv The arguments to use within the function (session #, CS pin #, 32-bit clock speed, bit order, mode)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers spiSession(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 8) {
+		uint8_t id = argv[0];
+		uint8_t pin = argv[1];
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+
+		if (id < SPI_SESSIONS && spiHeld != id && pin < NUM_DIGITAL_PINS) {
+			struct spi_session *session = &sessions[id];
+			session->config = SPISettings(makeDWord(argv[2], argv[3], argv[4], argv[5]), argv[6], argv[7]);
+			session->csPort = portOutputRegister(digitalPinToPort(pin));
+			session->csMask = digitalPinToBitMask(pin);
+			session->used = true;
+
+			digitalWrite(pin, (uint8_t)HIGH);
+			pinMode(pin, (uint8_t)OUTPUT);
+			result.value[0] = 1;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Drive a session's chip select straight through its port register
+ * 
+ * @param session The SPI session
+ * @param asserted True to pull CS low
+ */
+static void spiSelect(struct spi_session *session, bool asserted) {
+	uint8_t oldSREG = SREG;
+	cli();
+	if (asserted) *session->csPort &= ~session->csMask;
+	else *session->csPort |= session->csMask;
+	SREG = oldSREG;
+}
+
+/**
+ * @brief Exchange data with a registered SPI peripheral. The bytes are exchanged in place in the
+ * argument buffer. With SPI_HOLD_CS set, CS and the bus stay claimed after the exchange so a
+ * multi-part transaction can span several commands; the next exchange without it releases them
+ * (an exchange of no bytes just releases them). Refused while a bulk transfer holds the bus.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (2+)
+ * @param argv The arguments to use within the function (session #, flags, bytes)
+ * @return struct containing the bytes received ((argc - 2) * uint8_t)
+ */
+struct registers spiExchange(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+	if (argc < 2) {
+		return result;
+	}
+
+	// A held transaction belongs to its session until it is released
+	uint8_t id = argv[0];
+	if (id >= SPI_SESSIONS || !sessions[id].used || (spiHeld >= 0 && spiHeld != id) || !spiBusFree()) {
+		return result;
+	}
+
+	struct spi_session *session = &sessions[id];
+	if (spiHeld < 0) {
+		SPI.beginTransaction(session->config);
+		spiSelect(session, true);
+	}
+
+	result.count = argc - 2;
+	result.value = argv + 2;
+	SPI.transfer(result.value, result.count);
+
+	if (argv[1] & SPI_HOLD_CS) {
+		spiHeld = id;
+	}
+	else {
+		spiSelect(session, false);
+		SPI.endTransaction();
+		spiHeld = -1;
+	}
+
+	return result;
+}
+
+/**
+ * @brief End a SPI connection between the Arduino and a peripheral, releasing any transaction held by SPIEXCHANGE
  * 
  * @param argc The number of arguments contained within the 'argv' array (0)
  * @param argv The arguments to use within the function (None)
@@ -380,9 +1777,193 @@ struct registers spiTransferBuf(uint8_t argc, uint8_t *argv) {
  */
 struct registers spiEnd(uint8_t argc, uint8_t *argv) {
 	if (argc == 0) {
+		// Let go of a transaction held with SPI_HOLD_CS, so its peripheral is deselected and the bus is free again
+		if (spiHeld >= 0) {
+			spiSelect(&sessions[spiHeld], false);
+			SPI.endTransaction();
+			spiHeld = -1;
+		}
 		SPI.end();
 	}
 
 	return VOID_STRUCT;
 }
+#endif
+
+#ifdef USE_BULK
+/**
+ * @brief Release the bus held by the open bulk transfer
+ */
+static void bulkRelease() {
+#ifdef USE_SPI
+	if (bulk.bus == BULK_SPI) {
+		digitalWrite(bulk.target, (uint8_t)HIGH);
+		SPI.endTransaction();
+	}
+#endif
+#ifdef USE_WIRE
+	if (bulk.bus == BULK_WIRE && bulk.remaining > 0) {
+		// The last read was sent without a STOP, so finish with a one byte read
+		Wire.requestFrom(bulk.target, (uint8_t)1);
+		while (Wire.available()) Wire.read();
+	}
+#endif
+	bulk.bus = BULK_CLOSED;
+}
+
+/**
+ * @brief Open a bulk transfer that is streamed in chunks with BULKTRANSFER.
+ * The bus is set up once here and stays claimed until the whole length has been transferred.
+ * SPI transfers use the current SPI settings and hold the chip select low throughout.
+ * I2C transfers are reads: the prefix is written, then chunks are read with repeated starts.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (4+)
+ * @param argv The arguments to use within the function (bus, CS pin / address, 16-bit length, prefix bytes)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers bulkBegin(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc >= 4) {
+		result = resultAlloc(1);
+		if (result.value == nullptr) return result;
+		result.value[0] = 0;
+
+		uint16_t length = makeWord(argv[2], argv[3]);
+		if (bulk.bus != BULK_CLOSED || length == 0) {
+			return result;
+		}
+
+		// Only the buses of the function groups that were built can be opened
+		bool opened = false;
+#ifdef USE_SPI
+		if (argv[0] == BULK_SPI) {
+			SPI.beginTransaction(SPISettings(settings.speed, settings.order, settings.mode));
+			digitalWrite(argv[1], (uint8_t)LOW);
+			for (int i = 4; i < argc; i++) {
+				SPI.transfer(argv[i]);
+			}
+			opened = true;
+		}
+#endif
+#ifdef USE_WIRE
+		if (argv[0] == BULK_WIRE) {
+			Wire.beginTransmission(argv[1]);
+			for (int i = 4; i < argc; i++) {
+				Wire.write(argv[i]);
+			}
+			if (Wire.endTransmission(false) != 0) {
+				return result;
+			}
+			opened = true;
+		}
+#endif
+		if (!opened) {
+			return result;
+		}
+
+		bulk.bus = argv[0];
+		bulk.target = argv[1];
+		bulk.remaining = length;
+		bulk.done = 0;
+		bulk.seq = 0;
+		bulk.last = 0;
+		result.value[0] = 1;
+	}
+
+	return result;
+}
+
+/**
+ * @brief Transfer the next chunk of the open bulk transfer.
+ * Chunks must arrive in sequence. If the response to a chunk is lost, the host sends the chunk again
+ * with the same sequence number and gets back the bytes that were already received, without the bus
+ * being touched again; this also works for the last chunk after the transfer has closed itself.
+ * Any other sequence number, or a chunk longer than BULK_CHUNK_MAX bytes, is not transferred.
+ * The transfer closes itself after the last byte.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (2+)
+ * @param argv The arguments to use within the function (sequence #, bytes to send (SPI) or byte count (I2C))
+ * @return struct containing the next expected sequence number, followed by the bytes received
+ */
+struct registers bulkTransfer(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc >= 2) {
+		// A resend of the previous chunk gets the same bytes back
+		if (bulk.last > 0 && argv[0] == (uint8_t)(bulk.seq - 1)) {
+			result = resultAlloc(1 + bulk.last);
+			if (result.value == nullptr) return result;
+			result.value[0] = bulk.seq;
+			memcpy(result.value + 1, bulkChunk, bulk.last);
+			return result;
+		}
+
+		uint8_t length = (bulk.bus == BULK_WIRE ? argv[1] : argc - 1);
+		bool accepted = bulk.bus != BULK_CLOSED && argv[0] == bulk.seq && length > 0 && length <= BULK_CHUNK_MAX
+			&& length <= bulk.remaining;
+
+		result = resultAlloc(1 + (accepted ? length : 0));
+		if (result.value == nullptr) return result;
+
+		if (accepted) {
+			uint8_t *chunk = result.value + 1;
+
+#ifdef USE_SPI
+			if (bulk.bus == BULK_SPI) {
+				// Exchange the staged bytes in place
+				memcpy(chunk, argv + 1, length);
+				SPI.transfer(chunk, length);
+			}
+#endif
+#ifdef USE_WIRE
+			if (bulk.bus == BULK_WIRE) {
+				// Wire can only buffer BUFFER_LENGTH bytes per request
+				for (uint8_t i = 0; i < length; ) {
+					uint8_t part = min(length - i, BUFFER_LENGTH);
+					bool last = (bulk.remaining - i == part);
+					Wire.requestFrom(bulk.target, part, (uint8_t)last);
+					while (part-- > 0) {
+						chunk[i++] = Wire.available() ? Wire.read() : 0;
+					}
+				}
+			}
+#endif
+
+			memcpy(bulkChunk, chunk, length);
+			bulk.last = length;
+			bulk.remaining -= length;
+			bulk.done += length;
+			bulk.seq++;
+			if (bulk.remaining == 0) {
+				bulkRelease();
+			}
+		}
+
+		result.value[0] = bulk.seq;
+	}
+
+	return result;
+}
+
+/**
+ * @brief End the bulk transfer early, or confirm that it has finished
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return struct containing the number of bytes transferred (uint16_t)
+ */
+struct registers bulkEnd(uint8_t argc, uint8_t *argv) {
+	struct registers result{VOID_STRUCT};
+
+	if (argc == 0) {
+		bulkRelease();
+		result = resultAlloc(2);
+		if (result.value == nullptr) return result;
+		result.value[0] = highByte(bulk.done);
+		result.value[1] = lowByte(bulk.done);
+	}
 
+	return result;
+}
+#endif
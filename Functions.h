@@ -14,18 +14,102 @@ Licensed under LGPL-2.1
 #include <stdlib.h>
 #include <stdint.h>
 #include <Arduino.h>
+#include "Modbus.h"
+#include "Arena.h"
+#include "Samples.h"
+
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+/** @brief Uncomment any of these to build only those function groups. With none of them uncommented, all groups are built */
+//#define USE_GPIO
+//#define USE_SERVO
+//#define USE_WIRE
+//#define USE_SPI
+
+#if !defined(USE_GPIO) && !defined(USE_SERVO) && !defined(USE_WIRE) && !defined(USE_SPI)
+#define USE_GPIO
+#define USE_SERVO
+#define USE_WIRE
+#define USE_SPI
+#endif
+
+/** @brief Bulk transfers stream over I2C or SPI, so they are built along with either */
+#if defined(USE_WIRE) || defined(USE_SPI)
+#define USE_BULK
+#endif
+
+#ifdef USE_SERVO
 #include <Servo.h>
+#endif
+#ifdef USE_WIRE
 #include <Wire.h>
+#endif
+#ifdef USE_SPI
 #include <SPI.h>
+#endif
 
-#ifndef FUNCTIONS_H
-#define FUNCTIONS_H
+/** @brief Uncomment to add the ADC interrupt handler, which runs ANALOGBURST with BURST_ASYNC in the background.
+ * Without it, a sketch can define its own ISR(ADC_vect), and BURST_ASYNC bursts never start */
+//#define USE_ADC_INTERRUPT
+
+#if defined(USE_ADC_INTERRUPT) && !defined(USE_GPIO)
+#error "USE_ADC_INTERRUPT needs the GPIO function group"
+#endif
+
+/** @brief Uncomment to also serve the pins as coils and discrete inputs, and the analog inputs as input registers,
+ * so standard Modbus masters can use them without the mailbox */
+//#define USE_NATIVE_IO
+
+#if defined(USE_NATIVE_IO) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_NATIVE_IO needs the coil and input functions left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+#if defined(USE_NATIVE_IO) && !defined(USE_GPIO)
+#error "USE_NATIVE_IO needs the GPIO function group"
+#endif
+
+/** @brief First pin served as a coil. Pins 0 and 1 are the hardware serial port, which a master could
+ * otherwise cut itself off from with one coil write, so they are only served as discrete inputs */
+#define IO_FIRST_COIL 2
+
+/** @brief Uncomment to add PINEVENT, which queues pin changes for the host. Its pin change interrupt handlers
+ * are the same vectors SoftwareSerial defines, so it can't be used with USE_SOFTWARE_SERIAL */
+//#define USE_PIN_EVENTS
+
+#if defined(USE_PIN_EVENTS) && !defined(USE_GPIO)
+#error "USE_PIN_EVENTS needs the GPIO function group"
+#endif
+
+#if defined(USE_PIN_EVENTS) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_PIN_EVENTS needs the input registers left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+#if defined(USE_PIN_EVENTS) && defined(USE_SOFTWARE_SERIAL)
+#error "USE_PIN_EVENTS and SoftwareSerial both define the pin change interrupt vectors"
+#endif
+
+/** @brief Uncomment to add CAPTURE, which records an analog input or a port at a fixed rate around a trigger */
+//#define USE_CAPTURE
+
+#if defined(USE_CAPTURE) && !defined(USE_GPIO)
+#error "USE_CAPTURE needs the GPIO function group"
+#endif
+
+#if defined(USE_CAPTURE) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_CAPTURE needs the input registers left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+/** @brief Captures are recorded by the ADC interrupt, so they bring its handler along */
+#if defined(USE_CAPTURE) && !defined(USE_ADC_INTERRUPT)
+#define USE_ADC_INTERRUPT
+#endif
 
 /**
  * @brief Combine four 8-bit integral types into one 32-bit integral type,
  * or in simpler terms, reassemble a uint32_t from four uint8_t's
  */
-#define makeDWord(i0, i1, i2, i3) ((uint32_t) (i0 << 24 | i1 << 16 | i2 << 8 | i3))
+#define makeDWord(i0, i1, i2, i3) ((uint32_t) (i0) << 24 | (uint32_t) (i1) << 16 | (uint32_t) (i2) << 8 | (uint32_t) (i3))
 
 // Command number associated with each function
 
@@ -50,11 +134,170 @@ Licensed under LGPL-2.1
 #define SPITRANSFER 18
 #define SPIEND 19
 
+// Commands 20-99 are left free for custom functions added with Modmata.attach()
+
+#define BULKBEGIN 100
+#define BULKTRANSFER 101
+#define BULKEND 102
+#define PORTMODE 103
+#define PORTWRITE 104
+#define PORTREAD 105
+#define PORTMAP 106
+#define ANALOGBURST 107
+#define ANALOGRESULT 108
+#define SERVOMOVE 109
+#define WIREBATCH 110
+#define WIREPOLL 111
+#define SPISESSION 112
+#define SPIEXCHANGE 113
+#define PROFILERESET 114
+#define PINEVENT 115
+#define BAUDRATE 116
+#define CONFIGBEGIN 117
+#define CONFIGCOMMIT 118
+#define CONFIGCLEAR 119
+#define SHIFTOUT 120
+#define SHIFTIN 121
+#define PULSEIN 122
+#define PULSEOUT 123
+#define MACROLOAD 124
+#define MACRORUN 125
+#define MACROSTOP 126
+#define CAPTURE 127
+
+// Buses that a bulk transfer can stream over
+
+#define BULK_CLOSED 0
+#define BULK_SPI 1
+#define BULK_WIRE 2
+
+/** @brief Number of servos that can be attached at the same time */
+#define SERVO_POOL_SIZE 8
+
+/** @brief Interval between motion profile updates, matching the 20ms servo frame */
+#define SERVO_TICK_MS 20
+
+// Operations in a WIREBATCH list
+
+#define WIRE_OP_WRITE 1
+#define WIRE_OP_READ 2
+#define WIRE_OP_DELAY 3
+
+/** @brief Number of I2C reads that can be refreshed in the background */
+#define WIRE_POLL_SLOTS 4
+
+/** @brief Largest number of bytes cached per background I2C read */
+#define WIRE_POLL_MAX_LEN 8
+
+/** @brief Input registers used by each cached read: status, timestamp (2), data */
+#define WIRE_POLL_STRIDE (3 + WIRE_POLL_MAX_LEN / 2)
+
+/** @brief Input registers used by the whole cache: device clock (2), then each cached read */
+#define WIRE_POLL_REG_COUNT (2 + WIRE_POLL_SLOTS * WIRE_POLL_STRIDE)
+
+// Flags in the high byte of a cached read's status register
+
+#define WIRE_POLL_VALID 0x01
+#define WIRE_POLL_FAILED 0x02
+
+/** @brief Number of SPI peripherals that can have a session registered at once */
+#define SPI_SESSIONS 4
+
+/** @brief SPIEXCHANGE flag: leave CS asserted so the next exchange continues the same transaction */
+#define SPI_HOLD_CS 0x01
+
+/** @brief Largest number of channels in one ANALOGBURST */
+#define ANALOG_BURST_MAX 16
+
+// ANALOGBURST mode bits
+
+#define BURST_OVERSAMPLE 0x01
+#define BURST_ASYNC 0x02
+#define BURST_PACKED 0x04
+#define BURST_DELTA 0x08
+
+/** @brief Longest PULSEIN timeout and PULSEOUT train (us). Both run inside the command, so nothing else is served meanwhile */
+#define PULSE_MAX_US 1000000UL
+
+/** @brief Number of pins that can be watched by PINEVENT at the same time */
+#define EVENT_PINS 8
+
+/** @brief Number of pin events buffered between reads by the host (a power of 2) */
+#define EVENT_QUEUE_SIZE 16
+
+/** @brief Number of events handed to the host by one read of the event input registers */
+#define EVENT_WINDOW 8
+
+// PINEVENT modes
+
+#define EVENT_OFF 0
+#define EVENT_CHANGE 1
+#define EVENT_RISING 2
+#define EVENT_FALLING 3
+
+// Layout of the pin event input registers, followed by EVENT_WINDOW events of
+// 3 registers each: pin << 8 | level, then the time of the change in microseconds (2 words)
+
+#define EVENT_PENDING 0
+#define EVENT_COUNT 1
+#define EVENT_DROPPED 2
+#define EVENT_FIRST 3
+#define EVENT_REG_COUNT (EVENT_FIRST + EVENT_WINDOW * 3)
+
+/** @brief Samples kept by CAPTURE. Fixed at 256, so the 8-bit ring index wraps by itself in the ADC interrupt */
+#define CAPTURE_SIZE 256
+
+// What CAPTURE records
+
+#define CAPTURE_ANALOG 0
+#define CAPTURE_PORT 1
+
+// CAPTURE trigger modes
+
+#define CAPTURE_NOW 0
+#define CAPTURE_RISING 1
+#define CAPTURE_FALLING 2
+#define CAPTURE_ABOVE 3
+#define CAPTURE_BELOW 4
+
+// States of a capture, served in its first input register
+
+#define CAPTURE_IDLE 0
+#define CAPTURE_ARMED 1
+#define CAPTURE_TRIGGERED 2
+#define CAPTURE_DONE 3
+
+/** @brief Highest Arduino port number (PB = 2, PC = 3, ...) present on this chip */
+#if defined(PORTL)
+#define LAST_PORT PL
+#elif defined(PORTK)
+#define LAST_PORT PK
+#elif defined(PORTJ)
+#define LAST_PORT PJ
+#elif defined(PORTH)
+#define LAST_PORT PH
+#elif defined(PORTG)
+#define LAST_PORT PG
+#elif defined(PORTF)
+#define LAST_PORT PF
+#elif defined(PORTE)
+#define LAST_PORT PE
+#else
+#define LAST_PORT PD
+#endif
+
+#define MAX_REG_COUNT 100
+
+/** @brief Largest argc that fits in the mailbox after the command register, which is also the most results a callback can return */
+#define MAX_ARGC ((MAX_REG_COUNT - 1) * 2)
+
 /**
  * @brief A data structure to describe function arguments and return values.
  * @param count The number of arguments contained within the array 'value'.
  * @param value A pointer to an array of bytes (8-bit integral types) that 
  * contains the values of the arguments or return values for a command.
+ * Results should be allocated with arenaAlloc(), or point into the callback's own argv to be
+ * returned in place; anything else is freed after the results are copied to the mailbox.
  */
 struct registers {
 	/** The number of arguments contained within the array 'value'. */
@@ -64,6 +307,7 @@ struct registers {
 	uint8_t * 	value;
 };
 
+#ifdef USE_SPI
 /**
  * @brief A data structure to describe a SPI connection's configuration settings.
  * Essentially the same as Arduino's 'SPIsettings' object
@@ -81,39 +325,390 @@ struct spi_settings {
 	/** The clock polarity and phase. */
 	uint8_t 	mode;
 };
+#endif
+
+#ifdef USE_BULK
+/**
+ * @brief A data structure to describe a bulk transfer that is streamed over several commands.
+ * @param bus The bus the transfer is open on (BULK_CLOSED when idle)
+ * @param target The chip select pin (SPI) or peripheral address (I2C)
+ * @param remaining The number of bytes left before the transfer completes
+ * @param done The number of bytes transferred so far
+ * @param seq The sequence number expected on the next chunk
+ * @param last The length of the previous chunk, which is kept in case the host asks for it again
+ */
+struct bulk_transfer {
+	/** The bus the transfer is open on (BULK_CLOSED when idle) */
+	uint8_t 	bus;
+
+	/** The chip select pin (SPI) or peripheral address (I2C) */
+	uint8_t 	target;
+
+	/** The number of bytes left before the transfer completes */
+	uint16_t 	remaining;
+
+	/** The number of bytes transferred so far */
+	uint16_t 	done;
+
+	/** The sequence number expected on the next chunk */
+	uint8_t 	seq;
+
+	/** The length of the previous chunk, which is kept in case the host asks for it again */
+	uint8_t 	last;
+};
+
+/** @brief Largest chunk of a bulk transfer. The last chunk is kept in static SRAM so it can be sent again,
+ * and it has to fit in the mailbox after the sequence number, so it is at most MAX_ARGC - 1 */
+#ifndef BULK_CHUNK_MAX
+#define BULK_CHUNK_MAX 64
+#endif
+
+static_assert(BULK_CHUNK_MAX <= MAX_ARGC - 1, "bulk chunks must fit in the mailbox after the sequence number");
+#endif
+
+#ifdef USE_SPI
+/**
+ * @brief A data structure to describe a SPI peripheral registered with SPISESSION.
+ * @param config The bus settings, built once when the session is registered
+ * @param csPort The output register of the chip select pin's port
+ * @param csMask The chip select pin's bit in its port
+ * @param used True once the session has been registered
+ */
+struct spi_session {
+	/** The bus settings, built once when the session is registered */
+	SPISettings 	config;
+
+	/** The output register of the chip select pin's port */
+	volatile uint8_t * 	csPort;
+
+	/** The chip select pin's bit in its port */
+	uint8_t 	csMask;
+
+	/** True once the session has been registered */
+	bool 		used;
+};
+#endif
+
+#ifdef USE_WIRE
+/**
+ * @brief A data structure to describe an I2C read that is refreshed in the background.
+ * @param addr The peripheral address
+ * @param reg The register to start reading from
+ * @param length The number of bytes to read (0 = slot unused)
+ * @param period The time between refreshes in milliseconds
+ * @param last The time of the last refresh attempt
+ */
+struct wire_poll {
+	/** The peripheral address */
+	uint8_t 	addr;
+
+	/** The register to start reading from */
+	uint8_t 	reg;
+
+	/** The number of bytes to read (0 = slot unused) */
+	uint8_t 	length;
+
+	/** The time between refreshes in milliseconds */
+	uint16_t 	period;
+
+	/** The time of the last refresh attempt */
+	unsigned long 	last;
+};
+#endif
+
+#ifdef USE_PIN_EVENTS
+/**
+ * @brief A data structure to describe a pin being watched for changes by PINEVENT
+ * @param pin The Arduino pin number
+ * @param mode The PINEVENT mode (EVENT_OFF = slot unused)
+ * @param level The level the pin had when it was last checked
+ * @param bit The pin's bit in its port
+ * @param input The port's input register
+ */
+struct event_pin {
+	/** The Arduino pin number */
+	uint8_t 	pin;
+
+	/** The PINEVENT mode (EVENT_OFF = slot unused) */
+	uint8_t 	mode;
+
+	/** The level the pin had when it was last checked */
+	uint8_t 	level;
+
+	/** The pin's bit in its port */
+	uint8_t 	bit;
+
+	/** The port's input register */
+	volatile uint8_t * 	input;
+};
+
+/**
+ * @brief A data structure to describe one change of a watched pin
+ * @param pin The Arduino pin number
+ * @param level The level the pin changed to (HIGH/LOW)
+ * @param time The time of the change in microseconds
+ */
+struct pin_event {
+	/** The Arduino pin number */
+	uint8_t 	pin;
+
+	/** The level the pin changed to (HIGH/LOW) */
+	uint8_t 	level;
+
+	/** The time of the change in microseconds */
+	unsigned long 	time;
+};
+#endif
+
+#ifdef USE_SERVO
+/**
+ * @brief A data structure to describe a pooled servo and the move it is making.
+ * Positions are kept in thousandths of a degree so that slow moves still advance every tick.
+ * @param servo The Servo object, created the first time the slot is used and reused after that
+ * @param pin The pin the servo is attached to
+ * @param used True while a servo is attached through this slot
+ * @param moving True while a SERVOMOVE is in progress
+ * @param position The current position (millidegrees)
+ * @param target The position being moved to (millidegrees)
+ * @param velocity The current speed (millidegrees/s)
+ * @param maxVelocity The cruise speed of the move (millidegrees/s)
+ * @param acceleration The acceleration of the move (millidegrees/s^2, 0 = start and stop at cruise speed)
+ */
+struct servo_slot {
+	/** The Servo object, created the first time the slot is used and reused after that */
+	Servo * 	servo;
+
+	/** The pin the servo is attached to */
+	uint8_t 	pin;
+
+	/** True while a servo is attached through this slot */
+	bool 		used;
+
+	/** True while a SERVOMOVE is in progress */
+	bool 		moving;
+
+	/** The current position (millidegrees) */
+	int32_t 	position;
+
+	/** The position being moved to (millidegrees) */
+	int32_t 	target;
+
+	/** The current speed (millidegrees/s) */
+	int32_t 	velocity;
+
+	/** The cruise speed of the move (millidegrees/s) */
+	int32_t 	maxVelocity;
+
+	/** The acceleration of the move (millidegrees/s^2, 0 = start and stop at cruise speed) */
+	int32_t 	acceleration;
+};
+#endif
+
+#ifdef USE_GPIO
+/**
+ * @brief A data structure to describe an analog burst that is sampled in the background by the ADC interrupt.
+ * @param channels The ADC channel of each requested input
+ * @param sums The running sum of samples for each channel
+ * @param count The number of channels in the burst
+ * @param factor Each channel is sampled 2^factor times
+ * @param mode The ANALOGBURST mode bits
+ * @param index The channel currently being converted
+ * @param rounds The number of passes over the channels still to be made
+ * @param busy True while conversions are still running
+ */
+struct analog_burst {
+	/** The ADC channel of each requested input */
+	uint8_t 	channels[ANALOG_BURST_MAX];
+
+	/** The running sum of samples for each channel */
+	uint16_t 	sums[ANALOG_BURST_MAX];
+
+	/** The number of channels in the burst */
+	uint8_t 	count;
+
+	/** Each channel is sampled 2^factor times */
+	uint8_t 	factor;
+
+	/** The ANALOGBURST mode bits */
+	uint8_t 	mode;
+
+	/** The channel currently being converted */
+	uint8_t 	index;
+
+	/** The number of passes over the channels still to be made */
+	uint8_t 	rounds;
+
+	/** True while conversions are still running */
+	bool 		busy;
+};
+#endif
+
+#ifdef USE_CAPTURE
+/**
+ * @brief A data structure to describe a capture being recorded by the ADC interrupt.
+ * The ADC runs freely at the chosen rate and paces the samples, even when a port is recorded.
+ * @param input The input register of the port being recorded, or nullptr to record the ADC (8 bits)
+ * @param level The trigger threshold (analog) or the mask of the trigger pins (port)
+ * @param mode The trigger mode (CAPTURE_NOW and following)
+ * @param pre The number of samples kept from before the trigger
+ * @param index Where the next sample is written in the ring of samples
+ * @param filled The number of samples taken before the trigger, up to 'pre'
+ * @param remaining The number of samples still to be taken after the trigger
+ * @param divider The number of conversions skipped between samples
+ * @param skip The number of conversions left to skip before the next sample
+ * @param above True if the last sample was at or above the threshold (or had a trigger pin HIGH)
+ * @param prescaler The ADC prescaler bits to restore when the capture ends
+ */
+struct capture_run {
+	/** The input register of the port being recorded, or nullptr to record the ADC (8 bits) */
+	volatile uint8_t * 	input;
+
+	/** The trigger threshold (analog) or the mask of the trigger pins (port) */
+	uint8_t 	level;
+
+	/** The trigger mode (CAPTURE_NOW and following) */
+	uint8_t 	mode;
+
+	/** The number of samples kept from before the trigger */
+	uint8_t 	pre;
+
+	/** Where the next sample is written in the ring of samples */
+	uint8_t 	index;
+
+	/** The number of samples taken before the trigger, up to 'pre' */
+	uint8_t 	filled;
+
+	/** The number of samples still to be taken after the trigger */
+	uint8_t 	remaining;
+
+	/** The number of conversions skipped between samples */
+	uint8_t 	divider;
+
+	/** The number of conversions left to skip before the next sample */
+	uint8_t 	skip;
+
+	/** True if the last sample was at or above the threshold (or had a trigger pin HIGH) */
+	bool 		above;
+
+	/** The ADC prescaler bits to restore when the capture ends */
+	uint8_t 	prescaler;
+};
+
+/**
+ * @brief The capture as it is served to the host: its state, the position of the trigger sample, then the samples.
+ * Each register holds two 8-bit samples, the earlier one in the high byte. The samples are put in time order
+ * the first time they are read after the capture is done.
+ * @param state The state of the capture (CAPTURE_IDLE and following)
+ * @param trigger The position of the trigger sample (the number of samples kept from before it)
+ * @param samples The samples
+ */
+struct capture_log {
+	/** The state of the capture (CAPTURE_IDLE and following) */
+	word 	state;
+
+	/** The position of the trigger sample (the number of samples kept from before it) */
+	word 	trigger;
+
+	/** The samples */
+	word 	samples[CAPTURE_SIZE / 2];
+};
+
+/** @brief Number of input registers used by the capture */
+#define CAPTURE_REG_COUNT (sizeof(struct capture_log) / sizeof(word))
+#endif
+
+
+// Result helpers
+
+struct registers resultAlloc(uint8_t count);
 
 
 // General Arduino functions
 
+#ifdef USE_GPIO
 struct registers pinMode(uint8_t argc, uint8_t *argv);
 struct registers digitalWrite(uint8_t argc, uint8_t *argv);
 struct registers digitalRead(uint8_t argc, uint8_t *argv);
 struct registers analogWrite(uint8_t argc, uint8_t *argv);
 struct registers analogRead(uint8_t argc, uint8_t *argv);
+struct registers analogBurst(uint8_t argc, uint8_t *argv);
+struct registers analogResult(uint8_t argc, uint8_t *argv);
+struct registers portMode(uint8_t argc, uint8_t *argv);
+struct registers portWrite(uint8_t argc, uint8_t *argv);
+struct registers portRead(uint8_t argc, uint8_t *argv);
+struct registers portMap(uint8_t argc, uint8_t *argv);
+struct registers shiftOut(uint8_t argc, uint8_t *argv);
+struct registers shiftIn(uint8_t argc, uint8_t *argv);
+struct registers pulseIn(uint8_t argc, uint8_t *argv);
+struct registers pulseOut(uint8_t argc, uint8_t *argv);
+#ifdef USE_NATIVE_IO
+void ioOutputsRead(word offset, word numregs);
+void ioInputsRead(word offset, word numregs);
+void ioCoilWrite(word offset, word value);
+void ioAnalogRead(word offset, word numregs);
+extern word ioPins[NUM_DIGITAL_PINS];
+extern word ioAnalog[NUM_ANALOG_INPUTS];
+#endif
+#ifdef USE_PIN_EVENTS
+struct registers pinEvent(uint8_t argc, uint8_t *argv);
+void eventDrain(word offset, word numregs);
+extern word eventRegisters[EVENT_REG_COUNT];
+#endif
+#ifdef USE_CAPTURE
+struct registers captureStart(uint8_t argc, uint8_t *argv);
+void captureRead(word offset, word numregs);
+extern volatile struct capture_log captureLog;
+#endif
+#endif
 
 
 // Servo functions
 
+#ifdef USE_SERVO
 struct registers servoAttach(uint8_t argc, uint8_t *argv);
 struct registers servoDetach(uint8_t argc, uint8_t *argv);
 struct registers servoWrite(uint8_t argc, uint8_t *argv);
 struct registers servoRead(uint8_t argc, uint8_t *argv);
+struct registers servoMove(uint8_t argc, uint8_t *argv);
+void servoUpdate();
+#endif
 
 
 // I2C functions
 
+#ifdef USE_WIRE
 struct registers wireBegin(uint8_t argc, uint8_t *argv);
 struct registers wireEnd(uint8_t argc, uint8_t *argv);
 struct registers wireSetClock(uint8_t argc, uint8_t *argv);
 struct registers wireWrite(uint8_t argc, uint8_t *argv);
 struct registers wireRead(uint8_t argc, uint8_t *argv);
+struct registers wireBatch(uint8_t argc, uint8_t *argv);
+#ifndef USE_HOLDING_REGISTERS_ONLY
+struct registers wirePoll(uint8_t argc, uint8_t *argv);
+void wirePollUpdate();
+extern word wirePollRegisters[WIRE_POLL_REG_COUNT];
+#endif
+#endif
 
 
 // SPI functions
 
+#ifdef USE_SPI
 struct registers spiBegin(uint8_t argc, uint8_t *argv);
 struct registers spiSettings(uint8_t argc, uint8_t *argv);
 struct registers spiTransferBuf(uint8_t argc, uint8_t *argv);
 struct registers spiEnd(uint8_t argc, uint8_t *argv);
+struct registers spiSession(uint8_t argc, uint8_t *argv);
+struct registers spiExchange(uint8_t argc, uint8_t *argv);
+#endif
+
+
+// Bulk transfer functions
+
+#ifdef USE_BULK
+struct registers bulkBegin(uint8_t argc, uint8_t *argv);
+struct registers bulkTransfer(uint8_t argc, uint8_t *argv);
+struct registers bulkEnd(uint8_t argc, uint8_t *argv);
+#endif
 
 #endif
@@ -0,0 +1,311 @@
+/*
+Modmata Macro
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Macro.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Run a short stored program of commands on the device, a few instructions at a time
+ * @date 2023-04-06
+ */
+
+#include "Macro.h"
+
+#ifdef USE_MACROS
+
+/** @brief Input registers with the state of the macro and its outputs (see MACRO_STATE and following) */
+word macroRegisters[MACRO_REG_COUNT];
+
+/** @brief The stored program */
+static uint8_t program[MACRO_SIZE];
+
+/** @brief Bytes of the stored program */
+static uint8_t programLength = 0;
+
+/** @brief Position of the next instruction */
+static uint8_t pc = 0;
+
+/** @brief Loops being run, innermost last */
+static struct macro_loop loops[MACRO_DEPTH];
+
+/** @brief Number of valid entries in 'loops' */
+static uint8_t depth = 0;
+
+/** @brief Length of the MACRO_DELAY being waited out (ms) */
+static uint16_t waitLength = 0;
+
+/** @brief Time the MACRO_DELAY being waited out started */
+static unsigned long waitStart = 0;
+
+/** @brief Results of the last MACRO_CALL */
+static uint8_t results[MACRO_RESULT_MAX];
+
+/** @brief Number of valid bytes in 'results' */
+static uint8_t resultCount = 0;
+
+/**
+ * @brief Work out the length of an instruction
+ * 
+ * @param at The position of the instruction
+ * @return The length in bytes, or 0 if the instruction runs past the end of the program
+ */
+static uint8_t macroSize(uint8_t at) {
+	if (at >= programLength) return 0;
+
+	uint16_t size = 1;
+	switch (program[at]) {
+		case MACRO_OUT: size = 2; break;
+		case MACRO_DELAY: size = 3; break;
+		case MACRO_LOOP: size = 3; break;
+		case MACRO_IF: size = 5; break;
+		case MACRO_CALL: size = (at + 2 < programLength ? 3 + program[at + 2] : 0); break;
+	}
+	return (size > 0 && at + size <= programLength ? size : 0);
+}
+
+/**
+ * @brief Stop the macro
+ * 
+ * @param state The state to report (MACRO_DONE or MACRO_FAILED)
+ * @param at The position to report, which is the failed instruction when the macro failed
+ */
+static void macroFinish(word state, uint8_t at) {
+	macroRegisters[MACRO_STATE] = state;
+	macroRegisters[MACRO_PC] = at;
+}
+
+/**
+ * @brief Compare the kept results, read as a big-endian number of up to 4 bytes, with a value
+ * 
+ * @param comparison The comparison (MACRO_LT and following)
+ * @param value The value to compare with
+ * @return True if the comparison holds
+ */
+static bool macroCompare(uint8_t comparison, uint16_t value) {
+	uint32_t result = 0;
+	for (uint8_t i = 0; i < resultCount && i < 4; i++) {
+		result = result << 8 | results[i];
+	}
+
+	switch (comparison) {
+		case MACRO_LT: return result < value;
+		case MACRO_LE: return result <= value;
+		case MACRO_GT: return result > value;
+		case MACRO_GE: return result >= value;
+		case MACRO_EQ: return result == value;
+		default: return result != value;
+	}
+}
+
+/**
+ * @brief Run the macro up to its next command or delay. Called from Modmata.available(), so the macro
+ * runs alongside the connection and the host can read its outputs, or stop it, at any time.
+ * 
+ * @param call Runs the commands of MACRO_CALL instructions
+ */
+void macroStep(TMacroCall call) {
+	if (macroRegisters[MACRO_STATE] != MACRO_RUNNING) return;
+	if (waitLength > 0) {
+		if (millis() - waitStart < waitLength) return;
+		waitLength = 0;
+	}
+
+	for (uint8_t steps = 0; steps < MACRO_STEP_MAX; steps++) {
+		if (pc == programLength) {
+			macroFinish(MACRO_DONE, pc);
+			return;
+		}
+
+		uint8_t at = pc;
+		uint8_t size = macroSize(at);
+		if (size == 0) {
+			macroFinish(MACRO_FAILED, at);
+			return;
+		}
+		const uint8_t *op = program + at;
+		pc += size;
+
+		switch (op[0]) {
+			case MACRO_END:
+				macroFinish(MACRO_DONE, at);
+				return;
+
+			case MACRO_CALL: {
+				// A macro cannot replace or restart itself
+				if (op[1] == MACROLOAD || op[1] == MACRORUN || op[1] == MACROSTOP) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+
+				// Commands may overwrite argv, so they get a copy of the arguments
+				uint8_t *argv = (uint8_t *)arenaAlloc(sizeof(uint8_t) * op[2]);
+				int count = -1;
+				if (argv != nullptr || op[2] == 0) {
+					memcpy(argv, op + 3, op[2]);
+					count = call(op[1], op[2], argv, results, MACRO_RESULT_MAX);
+				}
+				arenaReset();
+
+				if (count < 0) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+				resultCount = count;
+				macroRegisters[MACRO_PC] = pc;
+				return;
+			}
+
+			case MACRO_OUT:
+				if (op[1] + (resultCount + 1) / 2 > MACRO_OUTPUTS) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+				for (uint8_t i = 0; i < resultCount; i += 2) {
+					uint8_t low = (i + 1 < resultCount ? results[i + 1] : 0);
+					macroRegisters[MACRO_OUT_FIRST + op[1] + i / 2] = makeWord(results[i], low);
+				}
+				break;
+
+			case MACRO_DELAY:
+				waitLength = makeWord(op[1], op[2]);
+				waitStart = millis();
+				macroRegisters[MACRO_PC] = pc;
+				return;
+
+			case MACRO_LOOP:
+				if (depth == MACRO_DEPTH) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+				loops[depth].start = pc;
+				loops[depth].remaining = makeWord(op[1], op[2]);
+				depth++;
+				break;
+
+			case MACRO_NEXT: {
+				if (depth == 0) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+				struct macro_loop *loop = &loops[depth - 1];
+				if (loop->remaining == 0 || --loop->remaining > 0) pc = loop->start;
+				else depth--;
+				break;
+			}
+
+			case MACRO_BREAK: {
+				// Carry on after the MACRO_NEXT of the innermost loop, skipping any loops nested inside it
+				uint8_t nested = 0;
+				uint8_t next = pc;
+				uint8_t nextSize = 0;
+				while (depth > 0 && (nextSize = macroSize(next)) > 0) {
+					if (program[next] == MACRO_LOOP) nested++;
+					else if (program[next] == MACRO_NEXT && nested-- == 0) break;
+					next += nextSize;
+				}
+				if (depth == 0 || nextSize == 0) {
+					macroFinish(MACRO_FAILED, at);
+					return;
+				}
+				pc = next + 1;
+				depth--;
+				break;
+			}
+
+			case MACRO_IF:
+				if (!macroCompare(op[1], makeWord(op[2], op[3]))) {
+					if (pc + op[4] > programLength) {
+						macroFinish(MACRO_FAILED, at);
+						return;
+					}
+					pc += op[4];
+				}
+				break;
+
+			default:
+				macroFinish(MACRO_FAILED, at);
+				return;
+		}
+	}
+
+	macroRegisters[MACRO_PC] = pc;
+}
+
+/**
+ * @brief Store part of the macro program. The program is a list of instructions, one after another:
+ * - MACRO_END                                    (stop; reaching the end of the program also stops)
+ * - MACRO_CALL  | command # | argc | args        (run a command, which may be one added with attach(), and keep its results)
+ * - MACRO_OUT   | output #                       (copy the kept results into the output registers from output # on, packed like mailbox results)
+ * - MACRO_DELAY | 16-bit ms                      (wait, without holding up the connection)
+ * - MACRO_LOOP  | 16-bit count                   (run the instructions up to the matching MACRO_NEXT count times, 0 = until stopped)
+ * - MACRO_NEXT                                   (end of a loop body)
+ * - MACRO_BREAK                                  (leave the innermost loop)
+ * - MACRO_IF    | comparison | 16-bit value | n (skip the next n bytes unless the kept results compare true with the value)
+ * 
+ * A long program is stored with several MACROLOAD commands, each continuing where the last one ended.
+ * Loading stops the macro if it is running. Recording MACROLOAD and MACRORUN in the configuration profile (USE_CONFIG)
+ * keeps the macro in EEPROM and starts it at startup.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (1+)
+ * @param argv The arguments to use within the function (position, program bytes)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers macroLoad(uint8_t argc, uint8_t *argv) {
+	struct registers result = resultAlloc(1);
+	if (result.value == nullptr) return result;
+	result.value[0] = 0;
+
+	if (argc >= 1 && argv[0] <= programLength && argv[0] + argc - 1 <= MACRO_SIZE) {
+		if (macroRegisters[MACRO_STATE] == MACRO_RUNNING) macroRegisters[MACRO_STATE] = MACRO_IDLE;
+		memcpy(program + argv[0], argv + 1, argc - 1);
+		programLength = argv[0] + argc - 1;
+		result.value[0] = 1;
+	}
+
+	return result;
+}
+
+/**
+ * @brief Run the stored macro from the start, clearing its outputs. A macro that is already running starts over.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+struct registers macroRun(uint8_t argc, uint8_t *argv) {
+	struct registers result = resultAlloc(1);
+	if (result.value == nullptr) return result;
+	result.value[0] = 0;
+
+	if (argc == 0 && programLength > 0) {
+		pc = 0;
+		depth = 0;
+		waitLength = 0;
+		resultCount = 0;
+		memset(macroRegisters, 0, sizeof(macroRegisters));
+		macroRegisters[MACRO_STATE] = MACRO_RUNNING;
+		result.value[0] = 1;
+	}
+
+	return result;
+}
+
+/**
+ * @brief Stop the macro where it is. Its outputs are kept until it is run again.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return void (empty struct)
+ */
+struct registers macroStop(uint8_t argc, uint8_t *argv) {
+	if (macroRegisters[MACRO_STATE] == MACRO_RUNNING) {
+		macroRegisters[MACRO_STATE] = MACRO_IDLE;
+		macroRegisters[MACRO_PC] = pc;
+	}
+
+	return registers{0, nullptr};
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+Modmata Macro
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Macro.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Macro.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+#include "Functions.h"
+
+#ifndef MACRO_H
+#define MACRO_H
+
+/** @brief Uncomment to let the host store a short program of commands that runs on the device (see MACROLOAD) */
+//#define USE_MACROS
+
+#if defined(USE_MACROS) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_MACROS needs the input registers left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+/** @brief Bytes of program space */
+#define MACRO_SIZE 128
+
+/** @brief Deepest nesting of MACRO_LOOP */
+#define MACRO_DEPTH 4
+
+/** @brief Largest number of result bytes kept from a MACRO_CALL */
+#define MACRO_RESULT_MAX 8
+
+/** @brief Most instructions run by one macroStep(), so a loop with no commands or delays cannot stall the connection */
+#define MACRO_STEP_MAX 16
+
+// Instructions, each an opcode followed by its operands (16-bit operands are big-endian)
+
+#define MACRO_END 0
+#define MACRO_CALL 1
+#define MACRO_OUT 2
+#define MACRO_DELAY 3
+#define MACRO_LOOP 4
+#define MACRO_NEXT 5
+#define MACRO_BREAK 6
+#define MACRO_IF 7
+
+// Comparisons made by MACRO_IF between the kept results and a value
+
+#define MACRO_LT 0
+#define MACRO_LE 1
+#define MACRO_GT 2
+#define MACRO_GE 3
+#define MACRO_EQ 4
+#define MACRO_NE 5
+
+// Layout of the macro input registers, followed by MACRO_OUTPUTS output registers filled by MACRO_OUT
+
+#define MACRO_STATE 0
+#define MACRO_PC 1
+#define MACRO_OUT_FIRST 2
+#define MACRO_OUTPUTS 16
+#define MACRO_REG_COUNT (MACRO_OUT_FIRST + MACRO_OUTPUTS)
+
+// Values of the MACRO_STATE register
+
+#define MACRO_IDLE 0
+#define MACRO_RUNNING 1
+#define MACRO_DONE 2
+#define MACRO_FAILED 3
+
+/**
+ * @brief A data structure to describe a MACRO_LOOP that is being run
+ * @param start The position of the first instruction of the loop body
+ * @param remaining The number of times the body is still to be run (0 = until stopped)
+ */
+struct macro_loop {
+	/** The position of the first instruction of the loop body */
+	uint8_t 	start;
+
+	/** The number of times the body is still to be run (0 = until stopped) */
+	uint16_t 	remaining;
+};
+
+/**
+ * @brief Runs one command for a macro through the normal dispatch
+ * @param cmd The command #
+ * @param argc The number of arguments
+ * @param argv The arguments, which the command may overwrite
+ * @param results Filled with the command's results
+ * @param maxResults The number of result bytes that fit in 'results'
+ * @return The number of result bytes kept, or -1 if the command does not exist or takes a different argc
+ */
+typedef int (*TMacroCall)(uint8_t cmd, uint8_t argc, uint8_t *argv, uint8_t *results, uint8_t maxResults);
+
+#ifdef USE_MACROS
+extern word macroRegisters[MACRO_REG_COUNT];
+
+void macroStep(TMacroCall call);
+
+struct registers macroLoad(uint8_t argc, uint8_t *argv);
+struct registers macroRun(uint8_t argc, uint8_t *argv);
+struct registers macroStop(uint8_t argc, uint8_t *argv);
+#endif
+
+#endif
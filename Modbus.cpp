@@ -7,6 +7,8 @@
 Modbus::Modbus() {
     _regs_head = 0;
     _regs_last = 0;
+    _blocks_head = 0;
+    _hregCheck = 0;
 }
 
 TRegister* Modbus::searchRegister(word address) {
@@ -22,6 +24,76 @@ TRegister* Modbus::searchRegister(word address) {
 	return(0);
 }
 
+TRegBlock* Modbus::searchBlock(word address) {
+    TRegBlock *block = _blocks_head;
+    //blocks are few, so a short scan finds the one that covers address
+    while (block) {
+        if (address >= block->address && address - block->address < block->count) return(block);
+        block = block->next;
+    }
+    return(0);
+}
+
+bool Modbus::isRegister(word address) {
+    return this->searchBlock(address) || this->searchRegister(address);
+}
+
+word Modbus::blockIndex(TRegBlock* block, word address) {
+    word index = address - block->address;
+    //wide values sit low word first in memory, so reverse the words of each one for high word first
+    if (block->width > 1 && block->order == MB_HIGH_WORD_FIRST) {
+        index += block->width - 1 - 2 * (index % block->width);
+    }
+    return(index);
+}
+
+int Modbus::readSeq(word address, word numregs) {
+    TRegBlock *block = _blocks_head;
+    int sum = 0;
+    //only blocks that overlap the range matter
+    while (block) {
+        if (block->seq && address < block->address + block->count && block->address < address + numregs) {
+            byte seq = *block->seq;
+            if (seq & 1) return(-1);
+            sum += seq;
+        }
+        block = block->next;
+    }
+    return(sum);
+}
+
+bool Modbus::copyRegisters(word address, word numregs, byte* out) {
+    for (byte tries = 0; tries < MAX_SNAPSHOT_TRIES; tries++) {
+        int before = this->readSeq(address, numregs);
+        if (before < 0) continue;
+        seqBarrier();
+
+        for (word i = 0; i < numregs; i++) {
+            word val = this->Reg(address + i);
+            out[i * 2] = val >> 8;
+            out[i * 2 + 1] = val & 0xFF;
+        }
+
+        //no writer touched the blocks while they were copied
+        seqBarrier();
+        if (this->readSeq(address, numregs) == before) return true;
+    }
+    return false;
+}
+
+void Modbus::prepareRead(word address, word numregs) {
+    TRegBlock *block = _blocks_head;
+    //give every block that overlaps the range a chance to fill in its values
+    while (block) {
+        if (block->onRead && address < block->address + block->count && block->address < address + numregs) {
+            word first = max(address, block->address);
+            word last = min((word)(address + numregs), (word)(block->address + block->count));
+            block->onRead(first - block->address, last - first);
+        }
+        block = block->next;
+    }
+}
+
 void Modbus::addReg(word address, word value) {
     TRegister *newreg;
 
@@ -41,7 +113,30 @@ void Modbus::addReg(word address, word value) {
     }
 }
 
+void Modbus::addBlock(word address, word* values, word count, TRegRead onRead, volatile byte* seq) {
+    TRegBlock *newblock;
+
+    newblock = (TRegBlock *) malloc(sizeof(TRegBlock));
+    newblock->address = address;
+    newblock->count = count;
+    newblock->values = values;
+    newblock->onRead = onRead;
+    newblock->onWrite = 0;
+    newblock->seq = seq;
+    newblock->width = 1;
+    newblock->order = MB_LOW_WORD_FIRST;
+    newblock->next = _blocks_head;
+    _blocks_head = newblock;
+}
+
 bool Modbus::Reg(word address, word value) {
+    TRegBlock *block = this->searchBlock(address);
+    if (block) {
+        block->values[this->blockIndex(block, address)] = value;
+        if (block->onWrite) block->onWrite(address - block->address, value);
+        return true;
+    }
+
     TRegister *reg;
     //search for the register address
     reg = this->searchRegister(address);
@@ -54,6 +149,9 @@ bool Modbus::Reg(word address, word value) {
 }
 
 word Modbus::Reg(word address) {
+    TRegBlock *block = this->searchBlock(address);
+    if (block) return(block->values[this->blockIndex(block, address)]);
+
     TRegister *reg;
     reg = this->searchRegister(address);
     if(reg)
@@ -66,6 +164,10 @@ void Modbus::addHreg(word offset, word value) {
     this->addReg(offset + 40001, value);
 }
 
+void Modbus::addHregBlock(word offset, word* values, word count, TRegRead onRead, volatile byte* seq) {
+    this->addBlock(offset + 40001, values, count, onRead, seq);
+}
+
 bool Modbus::Hreg(word offset, word value) {
     return Reg(offset + 40001, value);
 }
@@ -74,6 +176,16 @@ word Modbus::Hreg(word offset) {
     return Reg(offset + 40001);
 }
 
+void Modbus::onHregWrite(THregCheck check) {
+    _hregCheck = check;
+}
+
+void Modbus::bindHreg(word offset, void* data, word count, byte width, byte order) {
+    this->addBlock(offset + 40001, (word*) data, count, 0, 0);
+    _blocks_head->width = width;
+    _blocks_head->order = order;
+}
+
 #ifndef USE_HOLDING_REGISTERS_ONLY
     void Modbus::addCoil(word offset, bool value) {
         this->addReg(offset + 1, value?0xFF00:0x0000);
@@ -87,6 +199,25 @@ word Modbus::Hreg(word offset) {
         this->addReg(offset + 30001, value);
     }
 
+    void Modbus::addIregBlock(word offset, word* values, word count, TRegRead onRead, volatile byte* seq) {
+        this->addBlock(offset + 30001, values, count, onRead, seq);
+    }
+
+    void Modbus::bindIreg(word offset, void* data, word count, byte width, byte order) {
+        this->addBlock(offset + 30001, (word*) data, count, 0, 0);
+        _blocks_head->width = width;
+        _blocks_head->order = order;
+    }
+
+    void Modbus::addCoilBlock(word offset, word* values, word count, TRegRead onRead, TRegWrite onWrite) {
+        this->addBlock(offset + 1, values, count, onRead, 0);
+        _blocks_head->onWrite = onWrite;
+    }
+
+    void Modbus::addIstsBlock(word offset, word* values, word count, TRegRead onRead) {
+        this->addBlock(offset + 10001, values, count, onRead, 0);
+    }
+
     bool Modbus::Coil(word offset, bool value) {
         return Reg(offset + 1, value?0xFF00:0x0000);
     }
@@ -172,10 +303,13 @@ void Modbus::receivePDU(byte* frame) {
 }
 
 void Modbus::exceptionResponse(byte fcode, byte excode) {
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
     _len = 2;
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
+    if (!_frame) {
+        _reply = MB_REPLY_OFF;
+        return;
+    }
     _frame[0] = fcode + 0x80;
     _frame[1] = excode;
 
@@ -191,21 +325,20 @@ void Modbus::readRegisters(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 40001)) {
+    if (!this->isRegister(startreg + 40001)) {
         this->exceptionResponse(MB_FC_READ_REGS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
 
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 0;
 
 	//calculate the query reply message length
 	//for each register queried add 2 bytes
 	_len = 2 + numregs * 2;
 
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_READ_REGS, MB_EX_SLAVE_FAILURE);
         return;
@@ -214,23 +347,33 @@ void Modbus::readRegisters(word startreg, word numregs) {
     _frame[0] = MB_FC_READ_REGS;
     _frame[1] = _len - 2;   //byte count
 
-    word val;
-    word i = 0;
-	while(numregs--) {
-        //retrieve the value from the register bank for the current register
-        val = this->Hreg(startreg + i);
-        //write the high byte of the register value
-        _frame[2 + i * 2]  = val >> 8;
-        //write the low byte of the register value
-        _frame[3 + i * 2] = val & 0xFF;
-        i++;
-	}
+    this->prepareRead(startreg + 40001, numregs);
+
+    //a block kept changing under the copy, so ask the master to try again
+    if (!this->copyRegisters(startreg + 40001, numregs, _frame + 2)) {
+        this->exceptionResponse(MB_FC_READ_REGS, MB_EX_SLAVE_BUSY);
+        return;
+    }
 
     _reply = MB_REPLY_NORMAL;
 }
 
 void Modbus::writeSingleRegister(word reg, word value) {
     //No necessary verify illegal value (EX_ILLEGAL_VALUE) - because using word (0x0000 - 0x0FFFF)
+    //Let the application reject the value before it is stored
+    if (_hregCheck && this->isRegister(reg + 40001)) {
+        byte buf[2] = {(byte)(value >> 8), (byte)(value & 0xFF)};
+        byte excode = _hregCheck(reg, 1, buf);
+        if (excode == MB_WRITE_DISCARD) {
+            _reply = MB_REPLY_ECHO;
+            return;
+        }
+        if (excode) {
+            this->exceptionResponse(MB_FC_WRITE_REG, excode);
+            return;
+        }
+    }
+
     //Check Address and execute (reg exists?)
     if (!this->Hreg(reg, value)) {
         this->exceptionResponse(MB_FC_WRITE_REG, MB_EX_ILLEGAL_ADDRESS);
@@ -255,16 +398,25 @@ void Modbus::writeMultipleRegisters(byte* frame,word startreg, word numoutputs,
 
     //Check Address (startreg...startreg + numregs)
     for (int k = 0; k < numoutputs; k++) {
-        if (!this->searchRegister(startreg + 40001 + k)) {
+        if (!this->isRegister(startreg + 40001 + k)) {
             this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_ILLEGAL_ADDRESS);
             return;
         }
     }
 
-    //Clean frame buffer
-    free(_frame);
+    //Let the application reject the values before any of them is stored
+    byte excode = 0;
+    if (_hregCheck) {
+        excode = _hregCheck(startreg, numoutputs, frame + 6);
+        if (excode && excode != MB_WRITE_DISCARD) {
+            this->exceptionResponse(MB_FC_WRITE_REGS, excode);
+            return;
+        }
+    }
+
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 5;
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_SLAVE_FAILURE);
         return;
@@ -276,6 +428,12 @@ void Modbus::writeMultipleRegisters(byte* frame,word startreg, word numoutputs,
     _frame[3] = numoutputs >> 8;
     _frame[4] = numoutputs & 0x00FF;
 
+    //Acknowledged, but the application asked for the values to be dropped
+    if (excode == MB_WRITE_DISCARD) {
+        _reply = MB_REPLY_NORMAL;
+        return;
+    }
+
     word val;
     word i = 0;
 	while(numoutputs--) {
@@ -300,13 +458,12 @@ void Modbus::readCoils(word startreg, word numregs) {
     //When I check all registers in range I got errors in ScadaBR
     //I think that ScadaBR request more than one in the single request
     //when you have more then one datapoint configured from same type.
-    if (!this->searchRegister(startreg + 1)) {
+    if (!this->isRegister(startreg + 1)) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 0;
 
     //Determine the message length = function type, byte count and
@@ -314,7 +471,7 @@ void Modbus::readCoils(word startreg, word numregs) {
 	_len = 2 + numregs/8;
 	if (numregs%8) _len++; //Add 1 to the message length for the partial byte.
 
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_SLAVE_FAILURE);
         return;
@@ -323,11 +480,14 @@ void Modbus::readCoils(word startreg, word numregs) {
     _frame[0] = MB_FC_READ_COILS;
     _frame[1] = _len - 2; //byte count (_len - function code and byte count)
 
+    this->prepareRead(startreg + 1, numregs);
+
     byte bitn = 0;
     word totregs = numregs;
     word i;
 	while (numregs--) {
-        i = (totregs - numregs) / 8;
+        //numregs was already decremented, so this is the index of the current coil
+        i = (totregs - numregs - 1) / 8;
 		if (this->Coil(startreg))
 			bitSet(_frame[2+i], bitn);
 		else
@@ -351,13 +511,12 @@ void Modbus::readInputStatus(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 10001)) {
+    if (!this->isRegister(startreg + 10001)) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 0;
 
     //Determine the message length = function type, byte count and
@@ -365,7 +524,7 @@ void Modbus::readInputStatus(word startreg, word numregs) {
 	_len = 2 + numregs/8;
 	if (numregs%8) _len++; //Add 1 to the message length for the partial byte.
 
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_READ_INPUT_STAT, MB_EX_SLAVE_FAILURE);
         return;
@@ -374,11 +533,14 @@ void Modbus::readInputStatus(word startreg, word numregs) {
     _frame[0] = MB_FC_READ_INPUT_STAT;
     _frame[1] = _len - 2;
 
+    this->prepareRead(startreg + 10001, numregs);
+
     byte bitn = 0;
     word totregs = numregs;
     word i;
 	while (numregs--) {
-        i = (totregs - numregs) / 8;
+        //numregs was already decremented, so this is the index of the current input
+        i = (totregs - numregs - 1) / 8;
 		if (this->Ists(startreg))
 			bitSet(_frame[2+i], bitn);
 		else
@@ -402,20 +564,19 @@ void Modbus::readInputRegisters(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 30001)) {
+    if (!this->isRegister(startreg + 30001)) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 0;
 
 	//calculate the query reply message length
 	//for each register queried add 2 bytes
 	_len = 2 + numregs * 2;
 
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_READ_INPUT_REGS, MB_EX_SLAVE_FAILURE);
         return;
@@ -424,17 +585,13 @@ void Modbus::readInputRegisters(word startreg, word numregs) {
     _frame[0] = MB_FC_READ_INPUT_REGS;
     _frame[1] = _len - 2;
 
-    word val;
-    word i = 0;
-	while(numregs--) {
-        //retrieve the value from the register bank for the current register
-        val = this->Ireg(startreg + i);
-        //write the high byte of the register value
-        _frame[2 + i * 2]  = val >> 8;
-        //write the low byte of the register value
-        _frame[3 + i * 2] = val & 0xFF;
-        i++;
-	}
+    this->prepareRead(startreg + 30001, numregs);
+
+    //a block kept changing under the copy, so ask the master to try again
+    if (!this->copyRegisters(startreg + 30001, numregs, _frame + 2)) {
+        this->exceptionResponse(MB_FC_READ_INPUT_REGS, MB_EX_SLAVE_BUSY);
+        return;
+    }
 
     _reply = MB_REPLY_NORMAL;
 }
@@ -472,16 +629,15 @@ void Modbus::writeMultipleCoils(byte* frame,word startreg, word numoutputs, byte
 
     //Check Address (startreg...startreg + numregs)
     for (int k = 0; k < numoutputs; k++) {
-        if (!this->searchRegister(startreg + 1 + k)) {
+        if (!this->isRegister(startreg + 1 + k)) {
             this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_ILLEGAL_ADDRESS);
             return;
         }
     }
 
-    //Clean frame buffer
-    free(_frame);
+    //Frame buffers come from the arena and are all released at the end of task()
 	_len = 5;
-    _frame = (byte *) malloc(_len);
+    _frame = (byte *) arenaAlloc(_len);
     if (!_frame) {
         this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_SLAVE_FAILURE);
         return;
@@ -497,7 +653,7 @@ void Modbus::writeMultipleCoils(byte* frame,word startreg, word numoutputs, byte
     word totoutputs = numoutputs;
     word i;
 	while (numoutputs--) {
-        i = (totoutputs - numoutputs) / 8;
+        i = (totoutputs - numoutputs - 1) / 8;
         this->Coil(startreg, bitRead(frame[6+i], bitn));
         //increment the bit index
         bitn++;
@@ -3,12 +3,14 @@
     Copyright (C) 2014 Andr Sarmento Barbosa
 */
 #include "Arduino.h"
+#include "Arena.h"
 
 #ifndef MODBUS_H
 #define MODBUS_H
 
 #define MAX_REGS     32
 #define MAX_FRAME   128
+#define MAX_SNAPSHOT_TRIES 4
 //#define USE_HOLDING_REGISTERS_ONLY
 
 typedef unsigned int u_int;
@@ -31,6 +33,37 @@ enum {
     MB_EX_ILLEGAL_ADDRESS  = 0x02, // Output Address not exists
     MB_EX_ILLEGAL_VALUE    = 0x03, // Output Value not in Range
     MB_EX_SLAVE_FAILURE    = 0x04, // Slave Deive Fails to process request
+    MB_EX_SLAVE_BUSY       = 0x06, // Slave Device Busy, retry later
+};
+
+//Called before holding registers are written by a master. values holds numregs
+//big-endian words exactly as received. Return 0 to accept the write, or an
+//exception code to reject it without touching any register. MB_WRITE_DISCARD
+//acknowledges the write as usual but leaves the registers as they are.
+typedef byte (*THregCheck)(word offset, word numregs, byte* values);
+#define MB_WRITE_DISCARD 0xFF
+
+//Called before a master reads registers of a block, so values that are produced
+//on demand can be filled in. offset is relative to the start of the block and
+//only the numregs registers being read are covered.
+typedef void (*TRegRead)(word offset, word numregs);
+
+//Called after a master has written one register or coil of a block, so the
+//value can take effect. offset is relative to the start of the block.
+typedef void (*TRegWrite)(word offset, word value);
+
+//Code that updates a block with a sequence counter (from an ISR or not) wraps
+//each update in seqBegin/seqEnd. Readers copy the block and retry if the
+//counter was odd or changed, so a reply never mixes old and new values.
+inline void seqBarrier() { __asm__ __volatile__("" ::: "memory"); }
+inline void seqBegin(volatile byte* seq) { (*seq)++; seqBarrier(); }
+inline void seqEnd(volatile byte* seq) { seqBarrier(); (*seq)++; }
+
+//Order of the words of values wider than one register. Values are kept low word
+//first in memory, as the AVR stores them, and swapped as they are served if needed.
+enum {
+    MB_HIGH_WORD_FIRST = 0x00, // Most significant word at the lowest address (Modbus convention)
+    MB_LOW_WORD_FIRST  = 0x01, // Least significant word at the lowest address
 };
 
 //Reply Types
@@ -46,10 +79,25 @@ typedef struct TRegister {
     struct TRegister* next;
 } TRegister;
 
+//A run of consecutive registers backed by an array owned by the application
+typedef struct TRegBlock {
+    word address;
+    word count;
+    word* values;
+    TRegRead onRead;
+    TRegWrite onWrite;
+    volatile byte* seq;
+    byte width;  // registers per value, for word ordering
+    byte order;
+    struct TRegBlock* next;
+} TRegBlock;
+
 class Modbus {
     private:
         TRegister *_regs_head;
         TRegister *_regs_last;
+        TRegBlock *_blocks_head;
+        THregCheck _hregCheck;
 
         void readRegisters(word startreg, word numregs);
         void writeSingleRegister(word reg, word value);
@@ -64,8 +112,15 @@ class Modbus {
         #endif
 
         TRegister* searchRegister(word addr);
+        TRegBlock* searchBlock(word addr);
+        bool isRegister(word addr);
+        word blockIndex(TRegBlock* block, word addr);
+        void prepareRead(word address, word numregs);
+        int readSeq(word address, word numregs);
+        bool copyRegisters(word address, word numregs, byte* out);
 
         void addReg(word address, word value = 0);
+        void addBlock(word address, word* values, word count, TRegRead onRead, volatile byte* seq);
         bool Reg(word address, word value);
         word Reg(word address);
 
@@ -79,13 +134,20 @@ class Modbus {
         Modbus();
 
         void addHreg(word offset, word value = 0);
+        void addHregBlock(word offset, word* values, word count, TRegRead onRead = 0, volatile byte* seq = 0);
         bool Hreg(word offset, word value);
         word Hreg(word offset);
+        void onHregWrite(THregCheck check);
+        void bindHreg(word offset, void* data, word count, byte width, byte order);
 
         #ifndef USE_HOLDING_REGISTERS_ONLY
             void addCoil(word offset, bool value = false);
             void addIsts(word offset, bool value = false);
             void addIreg(word offset, word value = 0);
+            void addIregBlock(word offset, word* values, word count, TRegRead onRead = 0, volatile byte* seq = 0);
+            void bindIreg(word offset, void* data, word count, byte width, byte order);
+            void addCoilBlock(word offset, word* values, word count, TRegRead onRead, TRegWrite onWrite);
+            void addIstsBlock(word offset, word* values, word count, TRegRead onRead);
 
             bool Coil(word offset, bool value);
             bool Ists(word offset, bool value);
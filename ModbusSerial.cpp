@@ -5,7 +5,13 @@
 #include "ModbusSerial.h"
 
 ModbusSerial::ModbusSerial() {
-
+    _uart = 0;
+    #ifdef __AVR_ATmega32U4__
+    _usb = 0;
+    #endif
+    _confirmTimeout = 0;
+    _skipping = false;
+    _replyPending = false;
 }
 
 bool ModbusSerial::setSlaveId(byte slaveId){
@@ -17,10 +23,28 @@ byte ModbusSerial::getSlaveId() {
     return _slaveId;
 }
 
+bool ModbusSerial::config(HardwareSerial* port, long baud, u_int format, int txPin) {
+    this->_port = port;
+    this->_uart = port;
+    this->_txPin = txPin;
+    this->_format = format;
+    this->startPort(baud);
+
+    if (txPin >= 0) {
+        pinMode(txPin, OUTPUT);
+        digitalWrite(txPin, LOW);
+    }
+
+    return true;
+}
+
+#ifdef __AVR_ATmega32U4__
 bool ModbusSerial::config(Serial_* port, long baud, u_int format, int txPin) {
     this->_port = port;
+    this->_usb = port;
     this->_txPin = txPin;
-    (*port).begin(baud, format);
+    this->_format = format;
+    this->startPort(baud);
     while (!(*port));
 
     if (txPin >= 0) {
@@ -28,6 +52,20 @@ bool ModbusSerial::config(Serial_* port, long baud, u_int format, int txPin) {
         digitalWrite(txPin, LOW);
     }
 
+    return true;
+}
+#endif
+
+void ModbusSerial::startPort(long baud) {
+    _baud = baud;
+    if (_uart) {
+        (*_uart).end();
+        (*_uart).begin(baud, _format);
+    }
+    #ifdef __AVR_ATmega32U4__
+    if (_usb) (*_usb).begin(baud, _format);
+    #endif
+
     if (baud > 19200) {
         _t15 = 750;
         _t35 = 1750;
@@ -35,10 +73,26 @@ bool ModbusSerial::config(Serial_* port, long baud, u_int format, int txPin) {
         _t15 = 15000000/baud; // 1T * 1.5 = T1.5
         _t35 = 35000000/baud; // 1T * 3.5 = T3.5
     }
+}
+
+bool ModbusSerial::setBaud(long baud, word confirmTimeout) {
+    if (baud <= 0) return false;
 
+    //Let anything still being sent go out at the old rate
+    (*_port).flush();
+    _fallbackBaud = (_confirmTimeout ? _fallbackBaud : _baud);
+    this->startPort(baud);
+
+    //Until a frame arrives at the new rate, task() is ready to go back to the old one
+    _confirmTimeout = confirmTimeout;
+    _changedAt = millis();
     return true;
 }
 
+long ModbusSerial::getBaud() {
+    return _baud;
+}
+
 bool ModbusSerial::receive(byte* frame) {
     //first byte of frame = address
     byte address = frame[0];
@@ -111,9 +165,78 @@ bool ModbusSerial::sendPDU(byte* pduframe) {
     }
 }
 
+void ModbusSerial::skipFrame() {
+    if (!_skipping) {
+        _skipping = true;
+        _skipped = 0;
+        _skipLen = 0;
+        _lastByte = micros();
+    }
+
+    //Drop what has arrived, stopping where the length rules say the next frame starts.
+    //Bytes can wait in the UART buffer while a long command runs, so the time between reading them
+    //says nothing about the gaps between frames. Only an empty buffer that stays empty for t3.5 ends
+    //a frame whose length can't be known.
+    while ((*_port).available() && !(_skipLen && _skipped >= _skipLen)) {
+        byte b = (*_port).read();
+
+        if (_skipped == 0) {
+            //The master and slaves take turns, so a frame from the slave just asked is its reply
+            _skipAddress = b;
+            _skipReply = _replyPending && b == _replyAddress;
+        } else if (_skipped == 1) {
+            //Exception replies, requests of these function codes and write replies have a fixed length.
+            //Others are ended by the silence between frames.
+            _skipFcode = b;
+            if (b & 0x80) _skipLen = 5;
+            else if (!_skipReply && b >= MB_FC_READ_COILS && b <= MB_FC_WRITE_REG) _skipLen = 8;
+            else if (_skipReply && (b == MB_FC_WRITE_COIL || b == MB_FC_WRITE_REG || b == MB_FC_WRITE_COILS || b == MB_FC_WRITE_REGS)) _skipLen = 8;
+        } else if (_skipped == 2 && _skipReply && _skipFcode >= MB_FC_READ_COILS && _skipFcode <= MB_FC_READ_INPUT_REGS) {
+            //address, fcode, byte count, data, crc (2)
+            _skipLen = 5 + b;
+        } else if (_skipped == 6 && !_skipReply && (_skipFcode == MB_FC_WRITE_COILS || _skipFcode == MB_FC_WRITE_REGS)) {
+            //address, fcode, start (2), quantity (2), byte count, data, crc (2)
+            _skipLen = 9 + b;
+        }
+
+        _skipped++;
+        _lastByte = micros();
+    }
+
+    if ((_skipLen && _skipped >= _skipLen) || (!(*_port).available() && micros() - _lastByte >= _t35)) {
+        _skipping = false;
+
+        //A request is answered by its slave next, except a broadcast
+        _replyPending = !_skipReply && _skipAddress != 0;
+        _replyAddress = _skipAddress;
+        #ifdef USE_TRACE
+        byte header[5] = {_skipFcode, 0, 0, 0, 0};
+        traceRecord(TRACE_FOREIGN, _skipAddress, header, _skipped > 3 ? _skipped - 3 : 0, _lastByte);
+        #endif
+    }
+}
+
 word ModbusSerial::task() {
     _len = 0;
 
+    //The host never spoke at the new rate, so go back to the one it was using
+    if (_confirmTimeout && millis() - _changedAt >= _confirmTimeout) {
+        _confirmTimeout = 0;
+        this->startPort(_fallbackBaud);
+    }
+
+    //Frames for other slaves on a shared bus are dropped as they arrive, without buffering them or checking their CRC
+    bool foreign = false;
+    if (!_skipping && (*_port).available()) {
+        int address = (*_port).peek();
+        foreign = (address != this->getSlaveId() && address != 0xFF);
+    }
+    if (_skipping || foreign) {
+        this->skipFrame();
+        return false;
+    }
+    if ((*_port).available()) _replyPending = false;
+
     while ((*_port).available() > _len)	{
         _len = (*_port).available();
         delayMicroseconds(_t15);
@@ -121,19 +244,66 @@ word ModbusSerial::task() {
 
     if (_len == 0) return false;
 
+    #ifdef USE_PROFILING
+    unsigned long start = micros();
+    #endif
+
     byte i;
-    _frame = (byte*) malloc(_len);
+    _frame = (byte*) arenaAlloc(_len);
+    if (!_frame) {
+        //No room for the frame, so drop it
+        for (i=0 ; i < _len ; i++) (*_port).read();
+        _len = 0;
+        return false;
+    }
     for (i=0 ; i < _len ; i++) _frame[i] = (*_port).read();
+    byte fcode = (_len > 1 ? _frame[1] : 0);
+    #ifdef USE_TRACE
+    //receive() replaces _frame with the reply, but the request stays in the arena until the end
+    byte* request = _frame;
+    byte requestLen = (_len > 3 ? _len - 3 : 0);
+    unsigned long arrived = micros();
+    #endif
     
     if (this->receive(_frame)) {
+        #ifdef USE_TRACE
+        traceRecord(TRACE_RX, request[0], request + 1, requestLen, arrived);
+        #endif
+
+        //A frame for us arrived intact, so the current rate works
+        _confirmTimeout = 0;
+
+        #ifdef USE_PROFILING
+        //A normal reply with the high bit set on the function code is an exception
+        profileRecord(PROFILE_RECEIVE, fcode, micros() - start, _reply == MB_REPLY_NORMAL && (_frame[0] & 0x80));
+        start = micros();
+        #endif
+
         if (_reply == MB_REPLY_NORMAL)
             this->sendPDU(_frame);
         else
         if (_reply == MB_REPLY_ECHO)
             this->send(_frame);
+
+        #ifdef USE_PROFILING
+        if (_reply != MB_REPLY_OFF) profileRecord(PROFILE_SEND, fcode, micros() - start, false);
+        #endif
+
+        #ifdef USE_TRACE
+        //An echo sends the request frame back whole, a normal reply is a new PDU
+        if (_reply == MB_REPLY_NORMAL) traceRecord(TRACE_TX, _slaveId, _frame, _len, micros());
+        else if (_reply == MB_REPLY_ECHO) traceRecord(TRACE_TX, _frame[0], _frame + 1, _len > 3 ? _len - 3 : 0, micros());
+        #endif
+    }
+    #ifdef USE_TRACE
+    else if (request[0] == this->getSlaveId() || request[0] == 0xFF) {
+        //Addressed to us, so the CRC was bad
+        traceRecord(TRACE_CRC, request[0], request + 1, requestLen, arrived);
     }
+    #endif
     
-    free(_frame);
+    //Release the request and reply frames together
+    arenaReset();
     _len = 0;
     return true;
 }
@@ -4,6 +4,8 @@
 */
 #include <Arduino.h>
 #include <Modbus.h>
+#include "Profiler.h"
+#include "Trace.h"
 
 #ifndef MODBUSSERIAL_H
 #define MODBUSSERIAL_H
@@ -11,13 +13,31 @@
 class ModbusSerial : public Modbus {
     private:
         Stream* _port;
+        HardwareSerial* _uart;
+        #ifdef __AVR_ATmega32U4__
+        Serial_* _usb;
+        #endif
         long  _baud;
+        long  _fallbackBaud;      // rate restored if a change is not confirmed
+        unsigned long _changedAt; // time of the last unconfirmed change
+        word  _confirmTimeout;    // 0 when no change is waiting for confirmation
+        bool  _skipping;          // discarding a frame addressed to another slave
+        byte  _skipAddress;       // slave address of the frame being discarded
+        byte  _skipFcode;         // function code of the frame being discarded
+        word  _skipped;           // bytes of it discarded so far
+        word  _skipLen;           // its length, 0 while not known yet
+        bool  _skipReply;         // it is a reply rather than a request
+        bool  _replyPending;      // the last frame skipped was a request, so its reply comes next
+        byte  _replyAddress;      // slave address of the reply that comes next
+        unsigned long _lastByte;  // time the last of its bytes was discarded
         u_int _format;
         int   _txPin;
         unsigned int _t15; // inter character time out
         unsigned int _t35; // frame delay
         byte  _slaveId;
         word calcCrc(byte address, byte* pduframe, byte pdulen);
+        void startPort(long baud);
+        void skipFrame();
     public:
         ModbusSerial();
         bool setSlaveId(byte slaveId);
@@ -29,6 +49,8 @@ class ModbusSerial : public Modbus {
         #ifdef __AVR_ATmega32U4__
         bool config(Serial_* port, long baud, u_int format, int txPin=-1);
         #endif
+        bool setBaud(long baud, word confirmTimeout = 0);
+        long getBaud();
         word task();
         bool receive(byte* frame);
         bool sendPDU(byte* pduframe);
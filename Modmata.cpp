@@ -21,6 +21,132 @@ using namespace modmata;
 
 ModmataClass Modmata;
 
+/**
+ * @brief Switch the serial connection to a new baud rate. The result is read at the new rate,
+ * and if no frame arrives at the new rate before the timeout the old rate comes back.
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (4 or 6)
+ * @param argv The arguments to use within the function (32-bit baud rate, optional 16-bit timeout (ms, 0 = keep the new rate regardless))
+ * @return struct containing the boolean value of the operation's success (uint8_t)
+ */
+static struct registers baudRate(uint8_t argc, uint8_t *argv) {
+  struct registers result{1, (uint8_t *)arenaAlloc(sizeof(uint8_t))};
+  if (result.value == nullptr) return registers{0, nullptr};
+
+  long baud = makeDWord(argv[0], argv[1], argv[2], argv[3]);
+  word timeout = (argc == 6 ? makeWord(argv[4], argv[5]) : BAUD_CONFIRM_TIMEOUT);
+  result.value[0] = (argc == 4 || argc == 6) && Modmata.setBaud(baud, timeout);
+  return result;
+}
+
+/**
+ * @brief Free a callback's results, unless they are in the arena or in argv (which go with the arena)
+ * 
+ * @param result The results returned by the callback
+ * @param argc The number of arguments the callback was given
+ * @param argv The arguments the callback was given
+ */
+static void releaseResult(struct registers result, uint8_t argc, uint8_t *argv) {
+  bool inPlace = result.value >= argv && result.value < argv + argc;
+  if (result.value != nullptr && !inPlace && !arenaOwns(result.value)) free(result.value);
+}
+
+#ifdef USE_PROFILING
+/**
+ * @brief Clear the timing statistics so a new measurement window starts
+ * 
+ * @param argc The number of arguments contained within the 'argv' array (0)
+ * @param argv The arguments to use within the function (None)
+ * @return void (empty struct)
+ */
+static struct registers profileClear(uint8_t argc, uint8_t *argv) {
+  profileReset();
+  return registers{0, nullptr};
+}
+#endif
+
+/**
+ * @brief Default commands with the argument counts they accept, stored in flash.
+ * Commands not listed here (or attached) are rejected before anything is called.
+ */
+const struct command_entry defaultCommands[] PROGMEM = {
+#ifdef USE_GPIO
+  {PINMODE,       2, 2,        &pinMode},
+  {DIGITALWRITE,  2, 2,        &digitalWrite},
+  {DIGITALREAD,   1, 1,        &digitalRead},
+  {ANALOGWRITE,   3, 3,        &analogWrite},
+  {ANALOGREAD,    1, 1,        &analogRead},
+  {ANALOGBURST,   3, 2 + ANALOG_BURST_MAX, &analogBurst},
+  {ANALOGRESULT,  0, 0,        &analogResult},
+  {PORTMODE,      3, 3,        &portMode},
+  {PORTWRITE,     3, 3,        &portWrite},
+  {PORTREAD,      1, 1,        &portRead},
+  {PORTMAP,       1, 1,        &portMap},
+#ifdef USE_PIN_EVENTS
+  {PINEVENT,      2, 2,        &pinEvent},
+#endif
+  {SHIFTOUT,      5, MAX_ARGC, &shiftOut},
+  {SHIFTIN,       5, 5,        &shiftIn},
+  {PULSEIN,       6, 9,        &pulseIn},
+  {PULSEOUT,      8, 8,        &pulseOut},
+#ifdef USE_CAPTURE
+  {CAPTURE,       0, 7,        &captureStart},
+#endif
+#endif
+  {BAUDRATE,      4, 6,        &baudRate},
+
+#ifdef USE_CONFIG
+  {CONFIGBEGIN,   0, 0,        &configBegin},
+  {CONFIGCOMMIT,  2, 2,        &configCommit},
+  {CONFIGCLEAR,   0, 0,        &configClear},
+#endif
+
+#ifdef USE_SERVO
+  {SERVOATTACH,   1, 1,        &servoAttach},
+  {SERVODETACH,   1, 1,        &servoDetach},
+  {SERVOWRITE,    2, 2,        &servoWrite},
+  {SERVOREAD,     1, 1,        &servoRead},
+  {SERVOMOVE,     6, MAX_ARGC, &servoMove},
+#endif
+
+#ifdef USE_WIRE
+  {WIREBEGIN,     0, 0,        &wireBegin},
+  {WIREEND,       0, 0,        &wireEnd},
+  {WIRECLOCK,     4, 4,        &wireSetClock},
+  {WIREWRITE,     2, MAX_ARGC, &wireWrite},
+  {WIREREAD,      3, 3,        &wireRead},
+  {WIREBATCH,     2, MAX_ARGC, &wireBatch},
+#ifndef USE_HOLDING_REGISTERS_ONLY
+  {WIREPOLL,      6, 6,        &wirePoll},
+#endif
+#endif
+
+#ifdef USE_SPI
+  {SPIBEGIN,      0, 0,        &spiBegin},
+  {SPISETTINGS,   6, 6,        &spiSettings},
+  {SPITRANSFER,   2, MAX_ARGC, &spiTransferBuf},
+  {SPIEND,        0, 0,        &spiEnd},
+  {SPISESSION,    8, 8,        &spiSession},
+  {SPIEXCHANGE,   2, MAX_ARGC, &spiExchange},
+#endif
+
+#ifdef USE_PROFILING
+  {PROFILERESET,  0, 0,        &profileClear},
+#endif
+
+#ifdef USE_MACROS
+  {MACROLOAD,     1, MAX_ARGC, &macroLoad},
+  {MACRORUN,      0, 0,        &macroRun},
+  {MACROSTOP,     0, 0,        &macroStop},
+#endif
+
+#ifdef USE_BULK
+  {BULKBEGIN,     4, MAX_ARGC, &bulkBegin},
+  {BULKTRANSFER,  2, MAX_ARGC, &bulkTransfer},
+  {BULKEND,       0, 0,        &bulkEnd},
+#endif
+};
+
 /**
  * @brief Begin listening for a Modmata connection over serial/USB
  * @remark This is configured to be used between a host computer and Arduino Leonardo using a USB connector
@@ -28,97 +154,367 @@ ModmataClass Modmata;
  * in the usage of the serial connection, so if you modify this code, please keep that in mind.
  * @param baud Set the baud rate of the listening serial connection
  */
-void ModmataClass::begin(int baud) {
+void ModmataClass::begin(long baud) {
   mb.config(&Serial, baud, SERIAL_8N1);
   mb.setSlaveId(1);
-  
-  callbackFunctions[PINMODE] = &pinMode;
-  callbackFunctions[DIGITALWRITE] = &digitalWrite;
-  callbackFunctions[DIGITALREAD] = &digitalRead;
-  callbackFunctions[ANALOGWRITE] = &analogWrite;
-  callbackFunctions[ANALOGREAD] = &analogRead;
-  
-  callbackFunctions[SERVOATTACH] = &servoAttach;
-  callbackFunctions[SERVODETACH] = &servoDetach;
-  callbackFunctions[SERVOWRITE] = &servoWrite;
-  callbackFunctions[SERVOREAD] = &servoRead;
-
-  callbackFunctions[WIREBEGIN] = &wireBegin;
-  callbackFunctions[WIREEND] = &wireEnd;
-  callbackFunctions[WIRECLOCK] = &wireSetClock;
-  callbackFunctions[WIREWRITE] = &wireWrite;
-  callbackFunctions[WIREREAD] = &wireRead;
-
-  callbackFunctions[SPIBEGIN] = &spiBegin;
-  callbackFunctions[SPISETTINGS] = &spiSettings;
-  callbackFunctions[SPITRANSFER] = &spiTransferBuf;
-  callbackFunctions[SPIEND] = &spiEnd;
-
-  // Command register
-  for(int i = 0; i < MAX_REG_COUNT; i++) {
-    mb.addHreg(i);
+  mb.onHregWrite(&ModmataClass::checkCommand);
+
+  // Command registers, one mailbox slot after another
+  mb.addHregBlock(0, mailbox, MAILBOX_SLOTS * MAX_REG_COUNT);
+
+#if defined(USE_WIRE) && !defined(USE_HOLDING_REGISTERS_ONLY)
+  // Results of background I2C reads
+  mb.addIregBlock(WIRE_POLL_IREG, wirePollRegisters, WIRE_POLL_REG_COUNT);
+#endif
+
+#ifdef USE_PIN_EVENTS
+  // Pin changes caught by PINEVENT, taken off the queue as they are read
+  mb.addIregBlock(EVENT_IREG, eventRegisters, EVENT_REG_COUNT, &eventDrain);
+#endif
+
+#ifdef USE_CAPTURE
+  // State and samples of the latest capture, put in time order as they are read
+  mb.addIregBlock(CAPTURE_IREG, (word *)&captureLog, CAPTURE_REG_COUNT, &captureRead);
+#endif
+
+#ifndef USE_HOLDING_REGISTERS_ONLY
+  // Free RAM and arena usage
+  mb.addIregBlock(MEMORY_IREG, memoryRegisters, MEMORY_REG_COUNT);
+#endif
+
+#ifdef USE_CONFIG
+  // Version and hash of the stored configuration profile
+  mb.addIregBlock(CONFIG_IREG, configRegisters, CONFIG_REG_COUNT);
+#endif
+
+#ifdef USE_NATIVE_IO
+  // Pin # = coil # = discrete input #, so the two share their values. Both are filled in as they are read.
+  // The serial pins are left out of the coils (see IO_FIRST_COIL)
+  mb.addCoilBlock(IO_FIRST_COIL, ioPins + IO_FIRST_COIL, NUM_DIGITAL_PINS - IO_FIRST_COIL, &ioOutputsRead, &ioCoilWrite);
+  mb.addIstsBlock(0, ioPins, NUM_DIGITAL_PINS, &ioInputsRead);
+  mb.addIregBlock(ANALOG_IREG, ioAnalog, NUM_ANALOG_INPUTS, &ioAnalogRead);
+#endif
+
+#ifdef USE_PROFILING
+  // Timing statistics
+  mb.addIregBlock(PROFILE_IREG, (word *)profileEntries, PROFILE_REG_COUNT);
+#endif
+
+#ifdef USE_TRACE
+  // Headers and times of the latest frames
+  mb.addIregBlock(TRACE_IREG, (word *)&traceLog, TRACE_REG_COUNT);
+#endif
+
+#ifdef USE_MACROS
+  // State and outputs of the stored macro
+  mb.addIregBlock(MACRO_IREG, macroRegisters, MACRO_REG_COUNT);
+#endif
+
+#ifdef USE_CONFIG
+  restoreConfig();
+#endif
+}
+
+#ifdef USE_CONFIG
+/**
+ * @brief Move the configuration profile in the EEPROM, so it stays clear of the sketch's own EEPROM data.
+ * Must be called before begin(), which replays the profile.
+ * @param address The EEPROM address of the profile (CONFIG_EEPROM_ADDR by default)
+ * @return True if the profile's header fits at the address
+ */
+bool ModmataClass::setConfigAddress(word address) {
+  return configSetAddress(address);
+}
+
+/**
+ * @brief Run the commands of the configuration profile stored in EEPROM, so the device is set up
+ * before the first frame arrives. Commands added with attach() are only found if attach() was called before begin().
+ */
+void ModmataClass::restoreConfig() {
+  if (!configLoad()) return;
+
+  uint16_t length = configRegisters[CONFIG_LENGTH];
+  uint16_t i = 0;
+  while (i + 2 <= length) {
+    uint8_t cmd = configRead(i);
+    uint8_t argc = configRead(i + 1);
+    i += 2;
+    if (i + argc > length) break;
+
+    uint8_t *argv = (uint8_t *)arenaAlloc(sizeof(uint8_t) * argc);
+    if (argv == nullptr) break;
+    for (int j = 0; j < argc; j++) {
+      argv[j] = configRead(i + j);
+    }
+    i += argc;
+
+    struct command_entry entry;
+    if (lookup(cmd, &entry) && argc >= entry.minArgs && argc <= entry.maxArgs) {
+      releaseResult((entry.fn)(argc, argv), argc, argv);
+    }
+    arenaReset();
   }
+
+  configRegisters[CONFIG_STATE] |= CONFIG_RESTORED;
 }
+#endif
+
+/**
+ * @brief Change the baud rate of the listening serial connection
+ * @param baud The new baud rate
+ * @param confirmTimeout Time the host has to send a frame at the new rate before the old rate
+ * is restored (ms, 0 = keep the new rate regardless)
+ * @return True if the rate was changed
+ */
+bool ModmataClass::setBaud(long baud, word confirmTimeout) {
+  return mb.setBaud(baud, confirmTimeout);
+}
+
+#ifndef USE_HOLDING_REGISTERS_ONLY
+/**
+ * @brief Serve an array of the sketch's own as input registers, so the host can read it directly
+ * @param offset The first input register of the array
+ * @param values The array, which must outlive the connection
+ * @param count The number of registers in the array
+ * @param seq Optional sequence counter. Code that changes the array, including ISRs, wraps each change in
+ * seqBegin(seq) and seqEnd(seq), and reads are then retried until they get a copy no change happened during
+ */
+void ModmataClass::addIregBlock(word offset, word *values, word count, volatile byte *seq) {
+  mb.addIregBlock(offset, values, count, 0, seq);
+}
+#endif
 
 /**
  * @brief Assign a function to a command number. Standard commands have default functions, 
  * but those can be overwritten here, or more commands can be added.
  * @param command The modbus command being assigned a function
  * @param fn A pointer to the function to be called when the command is recieved
+ * @param minArgs The smallest argc accepted for this command
+ * @param maxArgs The largest argc accepted for this command
+ * @return True if the function was assigned, false if no attach slots are left
+ */
+bool ModmataClass::attach(uint8_t command, struct registers (*fn)(uint8_t argc, uint8_t *argv),
+                          uint8_t minArgs, uint8_t maxArgs) {
+  if (command == IDLE) return false;
+
+  // Reuse the slot if this command was attached before
+  uint8_t i = 0;
+  while (i < attachedCount && attached[i].code != command) i++;
+  if (i == MAX_ATTACHED) return false;
+  if (i == attachedCount) attachedCount++;
+
+  attached[i].code = command;
+  attached[i].minArgs = minArgs;
+  attached[i].maxArgs = maxArgs;
+  attached[i].fn = fn;
+  return true;
+}
+
+/**
+ * @brief Find the callback and argument limits for a command
+ * @param cmd The command number
+ * @param entry Filled with the matching dispatch entry
+ * @return True if the command exists
+ */
+bool ModmataClass::lookup(uint8_t cmd, struct command_entry *entry) {
+  for (uint8_t i = 0; i < attachedCount; i++) {
+    if (attached[i].code == cmd) {
+      *entry = attached[i];
+      return true;
+    }
+  }
+
+  for (uint8_t i = 0; i < sizeof(defaultCommands) / sizeof(defaultCommands[0]); i++) {
+    if (pgm_read_byte(&defaultCommands[i].code) == cmd) {
+      memcpy_P(entry, &defaultCommands[i], sizeof(struct command_entry));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#ifdef USE_MACROS
+/**
+ * @brief Run a command for the stored macro, the same way as commands from the mailbox
+ * @param cmd The command number
+ * @param argc The number of arguments
+ * @param argv The arguments, which the command may overwrite
+ * @param results Filled with the command's results
+ * @param maxResults The number of result bytes that fit in 'results'
+ * @return The number of result bytes kept, or -1 if the command does not exist or takes a different argc
+ */
+int ModmataClass::macroCall(uint8_t cmd, uint8_t argc, uint8_t *argv, uint8_t *results, uint8_t maxResults) {
+  struct command_entry entry;
+  if (!Modmata.lookup(cmd, &entry) || argc < entry.minArgs || argc > entry.maxArgs) return -1;
+
+#ifdef USE_PROFILING
+  unsigned long start = micros();
+#endif
+  struct registers result = (entry.fn)(argc, argv);
+#ifdef USE_PROFILING
+  profileRecord(PROFILE_COMMAND, cmd, micros() - start, false);
+#endif
+
+  uint8_t count = (result.value != nullptr ? min(result.count, maxResults) : 0);
+  memcpy(results, result.value, count);
+  releaseResult(result, argc, argv);
+  return count;
+}
+#endif
+
+/**
+ * @brief Validate a command before the host's write reaches the mailbox, so that unknown
+ * commands and bad argument counts are answered with a Modbus exception instead of being run.
+ * A write that ends with one register past the arguments carries a sequence number there (0 = none).
+ * A write repeating the last sequence number of its slot is a retry of a command that already arrived,
+ * so it is acknowledged but dropped, and the host reads the results of the first run.
+ * @param offset The first holding register being written
+ * @param numregs The number of holding registers being written
+ * @param values The register values as received (big-endian)
+ * @return 0 to accept the write, MB_WRITE_DISCARD to drop a retry, or a Modbus exception code
  */
-void ModmataClass::attach(uint8_t command, struct registers (*fn)(uint8_t argc, uint8_t *argv)) {
-  callbackFunctions[command] = fn;
+byte ModmataClass::checkCommand(word offset, word numregs, byte *values) {
+  int seqSlot = -1;
+  word seq = 0;
+
+  // Only writes to the command register of a slot carry a command
+  for (word i = 0; i < numregs; i++) {
+    if ((offset + i) % MAX_REG_COUNT != 0 || offset + i >= MAILBOX_SLOTS * MAX_REG_COUNT) continue;
+
+    uint8_t cmd = values[i * 2];
+    uint8_t argc = values[i * 2 + 1];
+    if (cmd == IDLE) continue;
+
+    // The sequence number has to be the last register written, and inside the slot
+    word seqIndex = i + 1 + (argc + 1) / 2;
+    if (seqIndex == numregs - 1 && seqIndex - i < MAX_REG_COUNT) {
+      seq = makeWord(values[seqIndex * 2], values[seqIndex * 2 + 1]);
+      seqSlot = (offset + i) / MAX_REG_COUNT;
+    }
+
+    struct command_entry entry;
+    byte excode = 0;
+    if (!Modmata.lookup(cmd, &entry)) excode = MB_EX_ILLEGAL_FUNCTION;
+    else if (argc < entry.minArgs || argc > entry.maxArgs) excode = MB_EX_ILLEGAL_VALUE;
+
+    if (excode) {
+#ifdef USE_PROFILING
+      profileRecord(PROFILE_COMMAND, cmd, 0, true);
+#endif
+      return excode;
+    }
+  }
+
+  if (seqSlot >= 0 && seq != 0) {
+    if (Modmata.lastSeq[seqSlot] == seq) return MB_WRITE_DISCARD;
+    Modmata.lastSeq[seqSlot] = seq;
+  }
+  return 0;
 }
 
 /**
- * @brief Read the command and args sent and execute the corresponding callback function,
- * store the results of which in holding functions to be communicated with the host.
+ * @brief Read the command and args sent to each mailbox slot and execute the corresponding callback
+ * function, store the results of which in holding functions to be communicated with the host.
  */
 void ModmataClass::processInput() {
+  for (int i = 0; i < MAILBOX_SLOTS; i++) {
+    if (highByte(mailbox[i * MAX_REG_COUNT])) {
+      processSlot(&mailbox[i * MAX_REG_COUNT]);
+    }
+  }
+}
+
+/**
+ * @brief Run the command waiting in one mailbox slot and replace its arguments with the results
+ * @param slot The slot's registers: the command register followed by MAX_REG_COUNT - 1 argument registers
+ */
+void ModmataClass::processSlot(word *slot) {
   // UNPACK COMMAND/FUNCTION CODE & NUMBER OF ARGS (ARGC)
-  uint16_t CMD_ARGC = mb.Hreg(0);
+  uint16_t CMD_ARGC = slot[0];
   int cmd = highByte(CMD_ARGC);
   int argc = lowByte(CMD_ARGC);
 
+  // Commands written by the host were checked already, but the register can also be set locally
+  struct command_entry entry;
+  if (!lookup(cmd, &entry) || argc < entry.minArgs || argc > entry.maxArgs) {
+#ifdef USE_PROFILING
+    profileRecord(PROFILE_COMMAND, cmd, 0, true);
+#endif
+    slot[0] = 0;
+    return;
+  }
+
   // Allocate space for argv to be transferred
-  uint8_t *argv = (uint8_t *)malloc(sizeof(uint8_t) * argc);
+  uint8_t *argv = (uint8_t *)arenaAlloc(sizeof(uint8_t) * argc);
+  if (argv == nullptr) {
+    slot[0] = 0;
+    return;
+  }
 
   // Read Hregs into argv
   for(int i = 0; i < argc; i++) {
-    uint16_t thisWord = mb.Hreg(i/2 + 1); // read Hreg()
+    uint16_t thisWord = slot[i/2 + 1];
 
     // set argv[i] to the low or high byte of the current holding register depending the parity of the current index
     argv[i] = (i % 2 == 0 ? highByte(thisWord) : lowByte(thisWord));
   }
 
+#ifdef USE_CONFIG
+  // Keep the command for the configuration profile before the callback can overwrite argv
+  configRecord(cmd, argc, argv);
+#endif
+
   // EXECUTE CALLBACK FUNCTION
-  struct registers result = (callbackFunctions[cmd])(argc, argv);
+#ifdef USE_PROFILING
+  unsigned long start = micros();
+#endif
+  struct registers result = (entry.fn)(argc, argv);
+#ifdef USE_PROFILING
+  profileRecord(PROFILE_COMMAND, cmd, micros() - start, false);
+#endif
+  memoryUpdate();
   
-  // RESPOND WITH RESULT
+  // RESPOND WITH RESULT (whatever does not fit in the slot is dropped)
+  if (result.count > MAX_ARGC) result.count = MAX_ARGC;
   for(int i = 0; i < result.count; i++) {
-    uint16_t thisWord = mb.Hreg(i/2 + 1); // Get the value of the current holding register
     uint8_t curResult = result.value[i];  // Get the value of the current result
 
     // Write half the holding register at a time, depending on whether 
     // it will be the high or low byte (determined by the parity of i)
-    mb.Hreg(i/2 + 1, (i % 2 == 0 ? makeWord(curResult, 0) : thisWord | curResult));
+    slot[i/2 + 1] = (i % 2 == 0 ? makeWord(curResult, 0) : slot[i/2 + 1] | curResult);
   }
   
-  // Deallocate memory
-  free(argv);
-  if (result.value != nullptr) free(result.value);
+  // Deallocate memory. Only results malloc'd by custom callbacks need freeing,
+  // everything from the arena (including argv and results in place) goes at once
+  releaseResult(result, argc, argv);
+  arenaReset();
 
   // Save the number of result values, return to idle command
-  mb.Hreg(0, result.count);
+  slot[0] = result.count;
 }
 
 /**
- * Update modbus registers and check if a command has been received
- * @remark Will return false unless there is a Command function code besides IDLE in Hreg 0
- * _and_ there was data received since the last time mb.task() was called 
+ * Update modbus registers, run background work such as servo moves and I2C polling, and check if a command has been received
+ * @remark Will return false unless there is a Command function code besides IDLE in
+ * the command register of at least one mailbox slot
  * @return True or false
  */
 bool ModmataClass::available() {
-  return mb.task() && (highByte(mb.Hreg(0)));
-}
+  mb.task();
+#ifdef USE_SERVO
+  servoUpdate();
+#endif
+#if defined(USE_WIRE) && !defined(USE_HOLDING_REGISTERS_ONLY)
+  wirePollUpdate();
+#endif
+#ifdef USE_MACROS
+  macroStep(&ModmataClass::macroCall);
+#endif
+  memoryUpdate();
 
+  for (int i = 0; i < MAILBOX_SLOTS; i++) {
+    if (highByte(mailbox[i * MAX_REG_COUNT])) return true;
+  }
+  return false;
+}
@@ -13,28 +13,180 @@ Licensed under LGPL-2.1
 
 #include "Functions.h"
 #include "ModbusSerial.h"
+#include "Profiler.h"
+#include "Config.h"
+#include "Macro.h"
 
 #ifndef MODMATA_H
 #define MODMATA_H
 
-#define MAX_REG_COUNT 100
+/** @brief Number of independent mailboxes. Slot n starts at holding register n * MAX_REG_COUNT.
+ * Each slot costs MAX_REG_COUNT * 2 + 2 bytes of static SRAM (202 bytes), so hosts that keep several
+ * commands in flight raise it with a build flag (e.g. -DMAILBOX_SLOTS=2) */
+#ifndef MAILBOX_SLOTS
+#define MAILBOX_SLOTS 1
+#endif
+
+/** @brief First input register of the analog inputs, when USE_NATIVE_IO is defined */
+#define ANALOG_IREG 0
+
+/** @brief First input register of the background I2C read cache (see WIREPOLL) */
+#define WIRE_POLL_IREG 100
+
+/** @brief First input register of the timing statistics table, when USE_PROFILING is defined */
+#define PROFILE_IREG 200
+
+/** @brief First input register of the memory statistics (see MEMORY_FREE and following in Arena.h) */
+#define MEMORY_IREG 380
+
+/** @brief First input register of the pin event queue, when USE_PIN_EVENTS is defined (see PINEVENT and EVENT_PENDING) */
+#define EVENT_IREG 400
+
+/** @brief First input register of the stored configuration profile's description, when USE_CONFIG is defined (see CONFIG_STATE and following) */
+#define CONFIG_IREG 500
+
+/** @brief First input register of the frame trace, when USE_TRACE is defined (see trace_log) */
+#define TRACE_IREG 600
+
+/** @brief First input register of the macro state and outputs, when USE_MACROS is defined (see MACRO_STATE and following) */
+#define MACRO_IREG 700
+
+/** @brief First input register of the capture, when USE_CAPTURE is defined (see capture_log) */
+#define CAPTURE_IREG 1000
+
+// The input register blocks above must not run into each other, or the later one hides the earlier one
+static_assert(ANALOG_IREG + NUM_ANALOG_INPUTS <= WIRE_POLL_IREG, "analog inputs overlap the I2C read cache");
+static_assert(WIRE_POLL_IREG + WIRE_POLL_REG_COUNT <= PROFILE_IREG, "I2C read cache overlaps the timing statistics");
+static_assert(PROFILE_IREG + PROFILE_REG_COUNT <= MEMORY_IREG, "timing statistics overlap the memory statistics");
+static_assert(MEMORY_IREG + MEMORY_REG_COUNT <= EVENT_IREG, "memory statistics overlap the pin event queue");
+static_assert(EVENT_IREG + EVENT_REG_COUNT <= CONFIG_IREG, "pin event queue overlaps the configuration registers");
+static_assert(CONFIG_IREG + CONFIG_REG_COUNT <= TRACE_IREG, "configuration registers overlap the frame trace");
+static_assert(TRACE_IREG + TRACE_REG_COUNT <= MACRO_IREG, "frame trace overlaps the macro registers");
+static_assert(MACRO_IREG + MACRO_REG_COUNT <= CAPTURE_IREG, "macro registers overlap the capture");
+
+#if (defined(USE_PROFILING) || defined(USE_TRACE)) && defined(USE_HOLDING_REGISTERS_ONLY)
+#error "USE_PROFILING and USE_TRACE need the input registers left out by USE_HOLDING_REGISTERS_ONLY"
+#endif
+
+/** @brief Time the host has to send a frame at the new rate after BAUDRATE, when it does not give one (ms) */
+#define BAUD_CONFIRM_TIMEOUT 2000
+
+/** @brief Number of commands that can be added or overridden at runtime with attach() */
+#define MAX_ATTACHED 8
 
 /** @brief Modmata namespace */
 namespace modmata {
 
+  /**
+   * @brief A data structure to describe a command that can be dispatched from the mailbox.
+   * @param code The command number written to the high byte of the command register.
+   * @param minArgs The smallest argc the callback accepts.
+   * @param maxArgs The largest argc the callback accepts.
+   * @param fn The callback function that executes the command.
+   */
+  struct command_entry {
+    /** The command number written to the high byte of the command register. */
+    uint8_t code;
+
+    /** The smallest argc the callback accepts. */
+    uint8_t minArgs;
+
+    /** The largest argc the callback accepts. */
+    uint8_t maxArgs;
+
+    /** The callback function that executes the command. */
+    struct registers (*fn)(uint8_t argc, uint8_t *argv);
+  };
+
   /** @brief Base class for a host computer to control this (LattePanda's Arduino Leonardo) device */
   class ModmataClass {
     public:
-      void begin(int baud);
-      void attach(uint8_t command, struct registers (*fn)(uint8_t argc, uint8_t *argv));
+      void begin(long baud);
+      bool setBaud(long baud, word confirmTimeout = 0);
+#ifdef USE_CONFIG
+      bool setConfigAddress(word address);
+#endif
+#ifndef USE_HOLDING_REGISTERS_ONLY
+      void addIregBlock(word offset, word *values, word count, volatile byte *seq = 0);
+#endif
+
+      /**
+       * @brief Serve a variable, array or struct as holding registers. FC03 reads it and FC06/FC16 write it
+       * straight from its memory, so nothing has to be copied in loop(). The registers must not overlap the
+       * mailbox (0 to MAILBOX_SLOTS * MAX_REG_COUNT - 1).
+       * @param offset The first holding register of the variable, after the mailbox
+       * @param var The variable, which must outlive the connection and be a whole number of registers long
+       * @param order Only for 32 and 64-bit integers and floating point values (and arrays of them): the order
+       * of their words (MB_HIGH_WORD_FIRST or MB_LOW_WORD_FIRST). Structs, and arrays of structs, are always
+       * served word by word as they are laid out in memory and ignore it, even when they hold 32-bit members.
+       * @return False if the registers would overlap the mailbox, in which case nothing is bound
+       */
+      template <typename T> bool bind(word offset, T &var, byte order = MB_HIGH_WORD_FIRST) {
+        static_assert(sizeof(T) % 2 == 0, "bound variables must be a whole number of registers");
+        if (offset < MAILBOX_SLOTS * MAX_REG_COUNT) return false;
+        mb.bindHreg(offset, &var, sizeof(T) / 2, bindWidth(&var), order);
+        return true;
+      }
+
+      /** @brief Serve each element of an array as holding registers (see bind() above) */
+      template <typename T, size_t N> bool bind(word offset, T (&var)[N], byte order = MB_HIGH_WORD_FIRST) {
+        static_assert(sizeof(T) % 2 == 0, "bound variables must be a whole number of registers");
+        if (offset < MAILBOX_SLOTS * MAX_REG_COUNT) return false;
+        mb.bindHreg(offset, var, sizeof(var) / 2, bindWidth(var), order);
+        return true;
+      }
+
+#ifndef USE_HOLDING_REGISTERS_ONLY
+      /** @brief Serve a variable, array or struct as read-only input registers, read with FC04 (see bind()) */
+      template <typename T> void bindInput(word offset, T &var, byte order = MB_HIGH_WORD_FIRST) {
+        static_assert(sizeof(T) % 2 == 0, "bound variables must be a whole number of registers");
+        mb.bindIreg(offset, &var, sizeof(T) / 2, bindWidth(&var), order);
+      }
+
+      /** @brief Serve each element of an array as input registers (see bind()) */
+      template <typename T, size_t N> void bindInput(word offset, T (&var)[N], byte order = MB_HIGH_WORD_FIRST) {
+        static_assert(sizeof(T) % 2 == 0, "bound variables must be a whole number of registers");
+        mb.bindIreg(offset, var, sizeof(var) / 2, bindWidth(var), order);
+      }
+#endif
+      bool attach(uint8_t command, struct registers (*fn)(uint8_t argc, uint8_t *argv),
+                  uint8_t minArgs = 0, uint8_t maxArgs = MAX_ARGC);
       void processInput();
       bool available();
     
     private:
+      void processSlot(word *slot);
+#ifdef USE_CONFIG
+      void restoreConfig();
+#endif
+      bool lookup(uint8_t cmd, struct command_entry *entry);
+      static byte checkCommand(word offset, word numregs, byte *values);
+#ifdef USE_MACROS
+      static int macroCall(uint8_t cmd, uint8_t argc, uint8_t *argv, uint8_t *results, uint8_t maxResults);
+#endif
+
+      /** @brief Registers per value of a bound type. Anything without an overload, such as a struct, is served word by word */
+      template <typename T> static byte bindWidth(const T *) { return 1; }
+      static byte bindWidth(const int32_t *) { return 2; }
+      static byte bindWidth(const uint32_t *) { return 2; }
+      static byte bindWidth(const int64_t *) { return 4; }
+      static byte bindWidth(const uint64_t *) { return 4; }
+      static byte bindWidth(const float *) { return sizeof(float) / 2; }
+      static byte bindWidth(const double *) { return sizeof(double) / 2; }
+
+      /** @brief Commands added with 'Modmata.attach( function_code, &function )'. 
+       * These are searched before the default commands, which live in flash */
+      struct command_entry attached[MAX_ATTACHED];
+
+      /** @brief Number of valid entries in 'attached' */
+      uint8_t attachedCount;
+
+      /** @brief Sequence number of the last command written to each mailbox slot, so retries are not run twice */
+      word lastSeq[MAILBOX_SLOTS];
 
-      /** @brief An array of references to callback functions indexed by their function code number. 
-       * Use 'Modmata.attach( function_code, &function )' to add your own callback functions */
-      struct registers (*callbackFunctions[100])(uint8_t argc, uint8_t *argv);
+      /** @brief Holding registers of every mailbox slot. Each slot is a command register
+       * (command in the high byte, argc or result count in the low byte) followed by its arguments */
+      word mailbox[MAILBOX_SLOTS * MAX_REG_COUNT];
 
       /** @brief Object representing an interactive Modbus connection over Serial */
       ModbusSerial mb;
@@ -0,0 +1,69 @@
+/*
+Modmata Profiler
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Profiler.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Keep call counts and timings for commands and Modbus function codes
+ * @date 2023-04-06
+ */
+
+#include "Profiler.h"
+
+#ifdef USE_PROFILING
+
+/** @brief Statistics for each code seen since the last reset, in the order they were first seen */
+struct profile_entry profileEntries[PROFILE_SLOTS];
+
+/**
+ * @brief Add one run of a command or function code to its statistics.
+ * Codes seen after the table is full are not recorded.
+ * 
+ * @param kind What the code refers to (PROFILE_COMMAND, PROFILE_RECEIVE or PROFILE_SEND)
+ * @param code The command or function code
+ * @param elapsed The time taken in microseconds
+ * @param error True if handling the code failed
+ */
+void profileRecord(uint8_t kind, uint8_t code, unsigned long elapsed, bool error) {
+	word key = makeWord(kind, code);
+	struct profile_entry *entry = nullptr;
+
+	for (int i = 0; i < PROFILE_SLOTS; i++) {
+		if (profileEntries[i].code == key || profileEntries[i].code == 0) {
+			entry = &profileEntries[i];
+			break;
+		}
+	}
+	if (entry == nullptr) return;
+
+	if (entry->code == 0) {
+		entry->code = key;
+		entry->min = 0xFFFF;
+	}
+
+	if (error && entry->errors < 0xFFFF) entry->errors++;
+
+	// Stop adding once the count saturates so that total / count stays the average
+	if (entry->count == 0xFFFF) return;
+	entry->count++;
+
+	word us = min(elapsed, 0xFFFFUL);
+	if (us < entry->min) entry->min = us;
+	if (us > entry->max) entry->max = us;
+
+	uint32_t total = ((uint32_t)entry->totalHigh << 16 | entry->totalLow) + elapsed;
+	entry->totalHigh = total >> 16;
+	entry->totalLow = total & 0xFFFF;
+}
+
+/**
+ * @brief Clear every statistic
+ */
+void profileReset() {
+	memset(profileEntries, 0, sizeof(profileEntries));
+}
+
+#endif
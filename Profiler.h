@@ -0,0 +1,76 @@
+/*
+Modmata Profiler
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Profiler.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Profiler.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/** @brief Uncomment to record timing statistics for every command and Modbus function code */
+//#define USE_PROFILING
+
+/** @brief Number of distinct codes that statistics are kept for */
+#define PROFILE_SLOTS 24
+
+// What a profiled code refers to, kept in the high byte of an entry's code
+
+#define PROFILE_COMMAND 1
+#define PROFILE_RECEIVE 2
+#define PROFILE_SEND 3
+
+/**
+ * @brief A data structure to describe the timing statistics of one command or function code.
+ * Every field is a whole input register, so the table is served to the host as it is.
+ * The average time is total / count.
+ * @param code The kind of code (high byte) and the command or function code (low byte), 0 if unused
+ * @param count The number of times the code was handled (stops at 65535)
+ * @param errors The number of times handling the code failed
+ * @param min The shortest time taken (microseconds)
+ * @param max The longest time taken (microseconds)
+ * @param totalHigh The high word of the total time taken (microseconds)
+ * @param totalLow The low word of the total time taken (microseconds)
+ */
+struct profile_entry {
+	/** The kind of code (high byte) and the command or function code (low byte), 0 if unused */
+	word 	code;
+
+	/** The number of times the code was handled (stops at 65535) */
+	word 	count;
+
+	/** The number of times handling the code failed */
+	word 	errors;
+
+	/** The shortest time taken (microseconds) */
+	word 	min;
+
+	/** The longest time taken (microseconds) */
+	word 	max;
+
+	/** The high word of the total time taken (microseconds) */
+	word 	totalHigh;
+
+	/** The low word of the total time taken (microseconds) */
+	word 	totalLow;
+};
+
+/** @brief Number of input registers used by the statistics table */
+#define PROFILE_REG_COUNT (PROFILE_SLOTS * sizeof(struct profile_entry) / sizeof(word))
+
+#ifdef USE_PROFILING
+extern struct profile_entry profileEntries[PROFILE_SLOTS];
+
+void profileRecord(uint8_t kind, uint8_t code, unsigned long elapsed, bool error);
+void profileReset();
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/*
+Modmata Samples
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Samples.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Compact encodings for lists of analog samples. Hosts decode them with tools/modmata_samples.py
+ * @date 2023-04-06
+ */
+
+#include "Samples.h"
+
+/**
+ * @brief Find how many bytes encoding a list of samples can take at most
+ * 
+ * @param count The number of samples
+ * @param encoding SAMPLE_WORDS, SAMPLE_PACKED or SAMPLE_DELTA
+ * @return The largest number of bytes sampleEncode() can write
+ */
+uint16_t sampleEncodedSize(uint8_t count, uint8_t encoding) {
+	if (count == 0) return 0;
+
+	switch (encoding) {
+		case SAMPLE_PACKED:
+			return count + (count + 3) / 4;
+		case SAMPLE_DELTA:
+			return 2 + (count - 1) * 3;
+		default:
+			return count * 2;
+	}
+}
+
+/**
+ * @brief Encode a list of samples. SAMPLE_PACKED keeps only the low 10 bits of each sample,
+ * so it is for raw ADC values; the other encodings keep all 16.
+ * 
+ * @param values The samples
+ * @param count The number of samples
+ * @param encoding SAMPLE_WORDS, SAMPLE_PACKED or SAMPLE_DELTA
+ * @param out Where to write the encoded bytes, with room for sampleEncodedSize(count, encoding)
+ * @return The number of bytes written
+ */
+uint16_t sampleEncode(const uint16_t *values, uint8_t count, uint8_t encoding, uint8_t *out) {
+	uint16_t length = 0;
+
+	if (encoding == SAMPLE_PACKED) {
+		for (uint8_t first = 0; first < count; first += 4) {
+			uint8_t group = min(count - first, 4);
+			uint8_t low = 0;
+			for (uint8_t i = 0; i < group; i++) {
+				out[length++] = (values[first + i] >> 2) & 0xFF;
+				low |= (values[first + i] & 0x03) << (6 - i * 2);
+			}
+			out[length++] = low;
+		}
+		return length;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		if (encoding == SAMPLE_DELTA && i > 0) {
+			int32_t delta = (int32_t)values[i] - values[i - 1];
+			if (delta > -128 && delta < 128) {
+				out[length++] = (uint8_t)delta;
+				continue;
+			}
+			out[length++] = SAMPLE_ESCAPE;
+		}
+		out[length++] = highByte(values[i]);
+		out[length++] = lowByte(values[i]);
+	}
+	return length;
+}
@@ -0,0 +1,38 @@
+/*
+Modmata Samples
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Samples.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Samples.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+// Ways a list of analog samples can be encoded in a result (decoded on the host by tools/modmata_samples.py, which must match)
+
+/** @brief Each sample in 2 bytes, high byte first */
+#define SAMPLE_WORDS 0
+
+/** @brief 10-bit samples in groups of 4, the top 8 bits of each sample in 4 bytes, then one byte
+ * holding the low 2 bits of all four (first sample in bits 7-6). A short last group is n + 1 bytes */
+#define SAMPLE_PACKED 1
+
+/** @brief The first sample in 2 bytes, then the change from the previous sample as a signed byte.
+ * Changes that do not fit are sent as SAMPLE_ESCAPE followed by the sample in 2 bytes */
+#define SAMPLE_DELTA 2
+
+/** @brief Marks a sample sent whole in SAMPLE_DELTA encoding */
+#define SAMPLE_ESCAPE 0x80
+
+uint16_t sampleEncodedSize(uint8_t count, uint8_t encoding);
+uint16_t sampleEncode(const uint16_t *values, uint8_t count, uint8_t encoding, uint8_t *out);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+Modmata Trace
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Trace.cpp
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Keep the headers and timing of the latest Modbus frames
+ * @date 2023-04-06
+ */
+
+#include "Trace.h"
+
+#ifdef USE_TRACE
+
+/** @brief The latest frames received and sent */
+struct trace_log traceLog;
+
+/**
+ * @brief Add a frame to the trace, replacing the oldest entry once the trace is full
+ * 
+ * @param kind What happened to the frame (TRACE_RX, TRACE_TX, TRACE_CRC or TRACE_FOREIGN)
+ * @param address The slave address of the frame
+ * @param pdu The frame after the address, of which only the first 5 bytes are kept
+ * @param pduLen The number of bytes after the address, not counting the CRC
+ * @param time The time the frame was received or sent (microseconds)
+ */
+void traceRecord(uint8_t kind, uint8_t address, const byte *pdu, uint8_t pduLen, unsigned long time) {
+	struct trace_entry *entry = &traceLog.entries[traceLog.count % TRACE_ENTRIES];
+	byte header[5] = {0, 0, 0, 0, 0};
+	memcpy(header, pdu, min(pduLen, (uint8_t)5));
+
+	entry->kind = makeWord(kind, min(pduLen + 3, 0xFF));
+	entry->function = makeWord(address, header[0]);
+	entry->field1 = makeWord(header[1], header[2]);
+	entry->field2 = makeWord(header[3], header[4]);
+	entry->timeHigh = time >> 16;
+	entry->timeLow = time & 0xFFFF;
+	traceLog.count++;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+Modmata Trace
+Copyright © 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+*/
+
+/**
+ * @file Trace.h
+ * @author Sam Hutcherson, Chase Wallendorff, Iris Astrid
+ * @brief Header file for 'Trace.cpp'
+ * @date 2023-04-06
+ */
+
+#include <Arduino.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/** @brief Uncomment to keep a trace of the latest frames received and sent, readable from the input registers */
+//#define USE_TRACE
+
+/** @brief Number of frames kept in the trace */
+#define TRACE_ENTRIES 16
+
+// What a trace entry records, kept in the high byte of an entry's kind
+
+#define TRACE_RX 1
+#define TRACE_TX 2
+#define TRACE_CRC 3
+#define TRACE_FOREIGN 4
+
+/**
+ * @brief A data structure to describe one traced frame, as its header and the time it was handled.
+ * Every field is a whole input register, so the trace is served to the host as it is.
+ * The gap between frames is the difference between the times of consecutive entries.
+ * @param kind What happened (high byte, TRACE_RX and following) and the frame length in bytes (low byte)
+ * @param function The slave address (high byte) and function code (low byte)
+ * @param field1 The first 2 bytes after the function code (start address of requests)
+ * @param field2 The next 2 bytes (quantity or value of requests)
+ * @param timeHigh The high word of the time the frame was handled (microseconds)
+ * @param timeLow The low word of the time the frame was handled (microseconds)
+ */
+struct trace_entry {
+	/** What happened (high byte, TRACE_RX and following) and the frame length in bytes (low byte) */
+	word 	kind;
+
+	/** The slave address (high byte) and function code (low byte) */
+	word 	function;
+
+	/** The first 2 bytes after the function code (start address of requests) */
+	word 	field1;
+
+	/** The next 2 bytes (quantity or value of requests) */
+	word 	field2;
+
+	/** The high word of the time the frame was handled (microseconds) */
+	word 	timeHigh;
+
+	/** The low word of the time the frame was handled (microseconds) */
+	word 	timeLow;
+};
+
+/**
+ * @brief The trace as it is served to the host: the number of entries ever recorded, then a ring of entries.
+ * The next entry is written at count % TRACE_ENTRIES, so that is where the oldest one is once the ring is full.
+ * @param count The number of entries recorded since startup (wraps at 65535)
+ * @param entries The latest entries
+ */
+struct trace_log {
+	/** The number of entries recorded since startup (wraps at 65535) */
+	word 	count;
+
+	/** The latest entries */
+	struct trace_entry 	entries[TRACE_ENTRIES];
+};
+
+/** @brief Number of input registers used by the trace */
+#define TRACE_REG_COUNT (sizeof(struct trace_log) / sizeof(word))
+
+#ifdef USE_TRACE
+extern struct trace_log traceLog;
+
+void traceRecord(uint8_t kind, uint8_t address, const byte *pdu, uint8_t pduLen, unsigned long time);
+#endif
+
+#endif
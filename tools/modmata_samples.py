@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""
+Modmata sample decoder
+Copyright (c) 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+
+Decode the analog samples returned by ANALOGBURST and ANALOGRESULT, which are
+encoded as their mode bits ask (see SAMPLE_WORDS and following in Samples.h).
+This is the reference decoder for host software. encode() mirrors sampleEncode()
+on the device, so the two can be checked against each other.
+
+    from modmata_samples import decode, SAMPLE_PACKED
+    values = decode(result_bytes, SAMPLE_PACKED)
+"""
+
+# Must match Samples.h
+SAMPLE_WORDS = 0
+SAMPLE_PACKED = 1
+SAMPLE_DELTA = 2
+SAMPLE_ESCAPE = 0x80
+
+
+def encode(values, encoding):
+    """Encode a list of samples the way sampleEncode() does. SAMPLE_PACKED keeps the low 10 bits."""
+    out = bytearray()
+    if encoding == SAMPLE_PACKED:
+        for first in range(0, len(values), 4):
+            group = values[first:first + 4]
+            low = 0
+            for i, value in enumerate(group):
+                out.append((value >> 2) & 0xFF)
+                low |= (value & 0x03) << (6 - i * 2)
+            out.append(low)
+        return bytes(out)
+
+    for i, value in enumerate(values):
+        if encoding == SAMPLE_DELTA and i > 0:
+            delta = value - values[i - 1]
+            if -128 < delta < 128:
+                out.append(delta & 0xFF)
+                continue
+            out.append(SAMPLE_ESCAPE)
+        out += bytes([value >> 8, value & 0xFF])
+    return bytes(out)
+
+
+def decode(data, encoding):
+    """Decode the bytes of a result into its list of samples."""
+    values = []
+    i = 0
+    if encoding == SAMPLE_PACKED:
+        # Each group is its samples' high bytes followed by one byte of low bits
+        while i + 1 < len(data):
+            group = min(len(data) - i - 1, 4)
+            low = data[i + group]
+            for j in range(group):
+                values.append(data[i + j] << 2 | (low >> (6 - j * 2)) & 0x03)
+            i += group + 1
+        return values
+
+    while i < len(data):
+        if encoding == SAMPLE_DELTA and values:
+            if data[i] != SAMPLE_ESCAPE:
+                delta = data[i] - 256 if data[i] & 0x80 else data[i]
+                values.append((values[-1] + delta) & 0xFFFF)
+                i += 1
+                continue
+            i += 1
+        if i + 1 >= len(data):
+            break
+        values.append(data[i] << 8 | data[i + 1])
+        i += 2
+    return values
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+Modmata trace tool
+Copyright (c) 2023 char* teamName <shutche@siue.edu>
+Licensed under LGPL-2.1
+
+Dump the frame trace kept by a device built with USE_TRACE, and replay a dumped
+trace against a device to compare response times between builds.
+
+    modmata_trace.py dump /dev/ttyACM0 > trace.csv
+    modmata_trace.py replay /dev/ttyACM0 trace.csv --speed 4
+
+Only the header of each frame is traced, so requests are replayed when the header
+holds all of them. Reads (function codes 1-4) are replayed by default; writes
+(function codes 5-6) re-run commands on the device and are only replayed with
+--writes. Needs pyserial.
+"""
+
+import argparse
+import csv
+import sys
+import time
+
+import serial
+
+# Must match Trace.h and Modmata.h
+TRACE_IREG = 600
+TRACE_ENTRIES = 16
+TRACE_ENTRY_WORDS = 6
+TRACE_KINDS = {1: "rx", 2: "tx", 3: "crc", 4: "foreign"}
+
+FIELDS = ["kind", "length", "address", "function", "field1", "field2", "time_us"]
+
+
+def crc16(data):
+    """Modbus RTU CRC, returned in the byte order it is sent."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return bytes([crc & 0xFF, crc >> 8])
+
+
+def request(address, function, field1, field2):
+    """Build a request frame whose data is two 16-bit fields."""
+    frame = bytes([address, function, field1 >> 8, field1 & 0xFF, field2 >> 8, field2 & 0xFF])
+    return frame + crc16(frame)
+
+
+def transact(port, frame, timeout, silence):
+    """Send a frame and collect the reply, which ends at the first silence. Returns the reply and seconds taken."""
+    port.reset_input_buffer()
+    start = time.perf_counter()
+    port.write(frame)
+    port.flush()
+
+    reply = b""
+    deadline = start + timeout
+    last = None
+    while time.perf_counter() < deadline:
+        waiting = port.in_waiting
+        if waiting:
+            reply += port.read(waiting)
+            last = time.perf_counter()
+        elif last is not None and time.perf_counter() - last >= silence:
+            break
+    return reply, (last or time.perf_counter()) - start
+
+
+def read_input_registers(port, slave, offset, count, timeout, silence):
+    reply, _ = transact(port, request(slave, 0x04, offset, count), timeout, silence)
+    if len(reply) < 5 + count * 2 or reply[1] != 0x04 or crc16(reply[:-2]) != reply[-2:]:
+        raise IOError("no valid reply reading input registers %d-%d" % (offset, offset + count - 1))
+    data = reply[3:3 + count * 2]
+    return [data[i] << 8 | data[i + 1] for i in range(0, len(data), 2)]
+
+
+def dump(args):
+    port = serial.Serial(args.port, args.baud, timeout=0)
+    words = read_input_registers(port, args.slave, TRACE_IREG, 1 + TRACE_ENTRIES * TRACE_ENTRY_WORDS,
+                                 args.timeout, args.silence)
+
+    # The ring is written at count % TRACE_ENTRIES, so the oldest entry is there once it is full
+    count = words[0]
+    first = count % TRACE_ENTRIES if count >= TRACE_ENTRIES else 0
+    writer = csv.writer(sys.stdout)
+    writer.writerow(FIELDS)
+    for i in range(min(count, TRACE_ENTRIES)):
+        at = 1 + ((first + i) % TRACE_ENTRIES) * TRACE_ENTRY_WORDS
+        kind, function, field1, field2, high, low = words[at:at + TRACE_ENTRY_WORDS]
+        writer.writerow([TRACE_KINDS.get(kind >> 8, kind >> 8), kind & 0xFF, function >> 8, function & 0xFF,
+                         field1, field2, high << 16 | low])
+
+
+def replay(args):
+    port = serial.Serial(args.port, args.baud, timeout=0)
+    with open(args.trace, newline="") as f:
+        last = 6 if args.writes else 4
+        rows = [row for row in csv.DictReader(f) if row["kind"] == "rx" and 1 <= int(row["function"]) <= last]
+    if not rows:
+        sys.exit("no replayable requests in " + args.trace)
+
+    times = {}
+    failures = 0
+    start = time.perf_counter()
+    origin = int(rows[0]["time_us"])
+    for row in rows:
+        # Keep the original spacing, scaled by --speed (0 sends as fast as replies allow)
+        if args.speed > 0:
+            due = start + ((int(row["time_us"]) - origin) & 0xFFFFFFFF) / 1e6 / args.speed
+            while time.perf_counter() < due:
+                pass
+
+        function = int(row["function"])
+        frame = request(int(row["address"]), function, int(row["field1"]), int(row["field2"]))
+        reply, elapsed = transact(port, frame, args.timeout, args.silence)
+        if len(reply) < 5 or crc16(reply[:-2]) != reply[-2:]:
+            failures += 1
+            continue
+        times.setdefault(function, []).append(elapsed)
+
+    print("function  count  min_ms  avg_ms  max_ms")
+    for function, samples in sorted(times.items()):
+        print("%8d  %5d  %6.2f  %6.2f  %6.2f" % (function, len(samples), min(samples) * 1e3,
+                                                sum(samples) / len(samples) * 1e3, max(samples) * 1e3))
+    print("%d of %d requests got no valid reply" % (failures, len(rows)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--slave", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=1.0, help="seconds to wait for a reply")
+    parser.add_argument("--silence", type=float, default=0.005, help="seconds of silence that end a reply")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    dump_parser = commands.add_parser("dump", help="print the device's trace as CSV")
+    dump_parser.add_argument("port")
+    dump_parser.set_defaults(run=dump)
+
+    replay_parser = commands.add_parser("replay", help="send the requests of a dumped trace again")
+    replay_parser.add_argument("port")
+    replay_parser.add_argument("trace")
+    replay_parser.add_argument("--speed", type=float, default=1.0, help="pace multiplier, 0 = no waiting")
+    replay_parser.add_argument("--writes", action="store_true", help="also send FC05/FC06 writes, which re-run commands")
+    replay_parser.set_defaults(run=replay)
+
+    args = parser.parse_args()
+    args.run(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Round-trip check of the sample encodings: python3 -m unittest discover tools"""
+
+import random
+import unittest
+
+from modmata_samples import SAMPLE_DELTA, SAMPLE_PACKED, SAMPLE_WORDS, decode, encode
+
+
+class RoundTrip(unittest.TestCase):
+    def check(self, values, encoding):
+        self.assertEqual(decode(encode(values, encoding), encoding), values)
+
+    def test_words(self):
+        self.check([0, 1, 0x1234, 0xFFFF], SAMPLE_WORDS)
+
+    def test_packed_groups(self):
+        # Whole groups of 4 and every length of short last group
+        for count in range(1, 10):
+            self.check([(i * 257) % 1024 for i in range(count)], SAMPLE_PACKED)
+
+    def test_packed_layout(self):
+        # High bytes, then the low bits with the first sample in bits 7-6
+        self.assertEqual(encode([0x3FF, 0x001], SAMPLE_PACKED), bytes([0xFF, 0x00, 0xC0 | 0x10]))
+
+    def test_delta_escapes(self):
+        # Changes of +-127 fit in a byte, anything further is sent whole after the escape
+        self.check([500, 627, 500, 372, 1000, 0, 0xFFFF], SAMPLE_DELTA)
+        self.assertEqual(encode([500, 372], SAMPLE_DELTA)[2], 0x80)
+
+    def test_random(self):
+        rng = random.Random(1)
+        for _ in range(200):
+            count = rng.randint(1, 16)
+            self.check([rng.randrange(1024) for _ in range(count)], SAMPLE_PACKED)
+            self.check([rng.randrange(65536) for _ in range(count)], SAMPLE_DELTA)
+            self.check([rng.randrange(65536) for _ in range(count)], SAMPLE_WORDS)
+
+    def test_empty(self):
+        for encoding in (SAMPLE_WORDS, SAMPLE_PACKED, SAMPLE_DELTA):
+            self.check([], encoding)
+
+
+if __name__ == "__main__":
+    unittest.main()